@@ -19,6 +19,7 @@
 #include "bulk-checkin.h"
 #include "argv-array.h"
 #include "submodule.h"
+#include "sparse-index.h"
 
 static const char * const builtin_add_usage[] = {
 	N_("git add [<options>] [--] <pathspec>..."),
@@ -460,6 +461,7 @@ int cmd_add(int argc, const char **argv, const char *prefix)
 		       prefix, argv);
 
 	die_path_inside_submodule(&the_index, &pathspec);
+	expand_index_for_pathspec(&the_index, &pathspec);
 
 	enable_fscache(1);
 	/* We do not really re-read the index but update the up-to-date flags */
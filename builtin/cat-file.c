@@ -13,6 +13,7 @@
 #include "tree-walk.h"
 #include "sha1-array.h"
 #include "packfile.h"
+#include "thread-utils.h"
 
 struct batch_options {
 	int enabled;
@@ -21,6 +22,7 @@ struct batch_options {
 	int buffer_output;
 	int all_objects;
 	int cmdmode; /* may be 'w' or 'c' for --filters or --textconv */
+	int threads;
 	const char *format;
 };
 
@@ -279,6 +281,72 @@ static void batch_write(struct batch_options *opt, const void *data, int len)
 		write_or_die(1, data, len);
 }
 
+/*
+ * With --threads, the contents of objects are not printed right away.
+ * They are queued together with their already expanded header lines and
+ * read by read_object_batch() when the queue is flushed, so that they
+ * can be inflated in parallel. Anything else that is to be printed
+ * flushes the queue first, to keep the output in the order of the input.
+ */
+#define MAX_QUEUED_OBJECTS 1024
+#define MAX_QUEUED_BYTES (64 * 1024 * 1024)
+
+struct queued_object {
+	char *header;
+	enum object_type type;
+	unsigned long size;
+};
+
+static struct object_read_request *queue_req;
+static struct queued_object *queue_obj;
+static size_t queue_nr, queue_req_alloc, queue_obj_alloc;
+static unsigned long queue_bytes;
+
+static void flush_object_queue(struct batch_options *opt)
+{
+	size_t i;
+
+	if (!queue_nr)
+		return;
+
+	read_object_batch(queue_req, queue_nr, opt->threads);
+	for (i = 0; i < queue_nr; i++) {
+		struct object_read_request *req = &queue_req[i];
+		struct queued_object *obj = &queue_obj[i];
+
+		if (!req->buf)
+			die("object %s disappeared", oid_to_hex(&req->oid));
+		if (req->type != obj->type)
+			die("object %s changed type!?", oid_to_hex(&req->oid));
+		if (req->size != obj->size)
+			die("object %s changed size!?", oid_to_hex(&req->oid));
+
+		batch_write(opt, obj->header, strlen(obj->header));
+		batch_write(opt, req->buf, req->size);
+		batch_write(opt, "\n", 1);
+		free(obj->header);
+		free(req->buf);
+	}
+	queue_nr = 0;
+	queue_bytes = 0;
+}
+
+static void queue_object(struct batch_options *opt, struct expand_data *data,
+			 struct strbuf *header)
+{
+	ALLOC_GROW(queue_req, queue_nr + 1, queue_req_alloc);
+	ALLOC_GROW(queue_obj, queue_nr + 1, queue_obj_alloc);
+	oidcpy(&queue_req[queue_nr].oid, &data->oid);
+	queue_obj[queue_nr].header = strbuf_detach(header, NULL);
+	queue_obj[queue_nr].type = data->type;
+	queue_obj[queue_nr].size = data->size;
+	queue_nr++;
+	queue_bytes += data->size;
+
+	if (queue_nr >= MAX_QUEUED_OBJECTS || queue_bytes >= MAX_QUEUED_BYTES)
+		flush_object_queue(opt);
+}
+
 static void print_object_or_die(struct batch_options *opt, struct expand_data *data)
 {
 	const struct object_id *oid = &data->oid;
@@ -342,6 +410,7 @@ static void batch_object_write(const char *obj_name, struct batch_options *opt,
 	if (!data->skip_object_info &&
 	    sha1_object_info_extended(data->oid.hash, &data->info,
 				      OBJECT_INFO_LOOKUP_REPLACE) < 0) {
+		flush_object_queue(opt);
 		printf("%s missing\n",
 		       obj_name ? obj_name : oid_to_hex(&data->oid));
 		fflush(stdout);
@@ -350,6 +419,14 @@ static void batch_object_write(const char *obj_name, struct batch_options *opt,
 
 	strbuf_expand(&buf, opt->format, expand_format, data);
 	strbuf_addch(&buf, '\n');
+
+	if (opt->print_contents && opt->threads > 1 &&
+	    data->size < big_file_threshold) {
+		queue_object(opt, data, &buf);
+		return;
+	}
+
+	flush_object_queue(opt);
 	batch_write(opt, buf.buf, buf.len);
 	strbuf_release(&buf);
 
@@ -368,6 +445,7 @@ static void batch_one_object(const char *obj_name, struct batch_options *opt,
 
 	result = get_oid_with_context(obj_name, flags, &data->oid, &ctx);
 	if (result != FOUND) {
+		flush_object_queue(opt);
 		switch (result) {
 		case MISSING_OBJECT:
 			printf("%s missing\n", obj_name);
@@ -394,6 +472,7 @@ static void batch_one_object(const char *obj_name, struct batch_options *opt,
 	}
 
 	if (ctx.mode == 0) {
+		flush_object_queue(opt);
 		printf("symlink %"PRIuMAX"\n%s\n",
 		       (uintmax_t)ctx.symlink_path.len,
 		       ctx.symlink_path.buf);
@@ -456,6 +535,13 @@ static int batch_objects(struct batch_options *opt)
 	if (opt->cmdmode)
 		data.split_on_whitespace = 1;
 
+	/*
+	 * Objects are queued for reading in parallel only if they are
+	 * small enough not to be streamed, so we need their size.
+	 */
+	if (opt->print_contents && opt->threads > 1)
+		data.info.sizep = &data.size;
+
 	if (opt->all_objects) {
 		struct object_info empty = OBJECT_INFO_INIT;
 		if (!memcmp(&data.info, &empty, sizeof(empty)))
@@ -481,6 +567,7 @@ static int batch_objects(struct batch_options *opt)
 		cb.opt = opt;
 		cb.expand = &data;
 		oid_array_for_each_unique(&sa, batch_object_cb, &cb);
+		flush_object_queue(opt);
 
 		oid_array_clear(&sa);
 		return 0;
@@ -513,6 +600,7 @@ static int batch_objects(struct batch_options *opt)
 
 		batch_one_object(buf.buf, opt, &data);
 	}
+	flush_object_queue(opt);
 
 	strbuf_release(&buf);
 	warn_on_object_refname_ambiguity = save_warning;
@@ -521,7 +609,7 @@ static int batch_objects(struct batch_options *opt)
 
 static const char * const cat_file_usage[] = {
 	N_("git cat-file (-t [--allow-unknown-type] | -s [--allow-unknown-type] | -e | -p | <type> | --textconv | --filters) [--path=<path>] <object>"),
-	N_("git cat-file (--batch | --batch-check) [--follow-symlinks] [--textconv | --filters]"),
+	N_("git cat-file (--batch | --batch-check) [--follow-symlinks] [--textconv | --filters | --threads=<n>]"),
 	NULL
 };
 
@@ -583,12 +671,15 @@ int cmd_cat_file(int argc, const char **argv, const char *prefix)
 			 N_("follow in-tree symlinks (used with --batch or --batch-check)")),
 		OPT_BOOL(0, "batch-all-objects", &batch.all_objects,
 			 N_("show all objects with --batch or --batch-check")),
+		OPT_INTEGER(0, "threads", &batch.threads,
+			    N_("read the objects shown by --batch with <n> threads")),
 		OPT_END()
 	};
 
 	git_config(git_cat_file_config, NULL);
 
 	batch.buffer_output = -1;
+	batch.threads = 1;
 	argc = parse_options(argc, argv, prefix, options, cat_file_usage, 0);
 
 	if (opt) {
@@ -612,12 +703,27 @@ int cmd_cat_file(int argc, const char **argv, const char *prefix)
 		if (batch.cmdmode && batch.all_objects)
 			die("--batch-all-objects cannot be combined with "
 			    "--textconv nor with --filters");
+		if (batch.cmdmode && batch.threads != 1)
+			die("--threads cannot be combined with "
+			    "--textconv nor with --filters");
 	}
 
-	if ((batch.follow_symlinks || batch.all_objects) && !batch.enabled) {
+	if ((batch.follow_symlinks || batch.all_objects || batch.threads != 1) &&
+	    !batch.enabled) {
 		usage_with_options(cat_file_usage, options);
 	}
 
+	if (batch.threads < 0)
+		die(_("invalid number of threads specified (%d)"), batch.threads);
+	if (!batch.threads)
+		batch.threads = online_cpus();
+#ifdef NO_PTHREADS
+	if (batch.threads > 1) {
+		warning(_("no threads support, ignoring --threads"));
+		batch.threads = 1;
+	}
+#endif
+
 	if (force_path && opt != 'c' && opt != 'w') {
 		error("--path=<path> needs --textconv or --filters");
 		usage_with_options(cat_file_usage, options);
@@ -22,6 +22,7 @@
 #include "resolve-undo.h"
 #include "submodule-config.h"
 #include "submodule.h"
+#include "sparse-index.h"
 
 static const char * const checkout_usage[] = {
 	N_("git checkout [<options>] <branch>"),
@@ -278,6 +279,7 @@ static int checkout_paths(const struct checkout_opts *opts,
 	hold_locked_index(&lock_file, LOCK_DIE_ON_ERROR);
 	if (read_cache_preload(&opts->pathspec) < 0)
 		return error(_("index file corrupt"));
+	expand_index_for_pathspec(&the_index, &opts->pathspec);
 
 	if (opts->source_tree)
 		read_tree_some(opts->source_tree, &opts->pathspec);
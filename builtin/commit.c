@@ -32,6 +32,7 @@
 #include "column.h"
 #include "sequencer.h"
 #include "mailmap.h"
+#include "sparse-index.h"
 
 static const char * const builtin_commit_usage[] = {
 	N_("git commit [<options>] [--] <pathspec>..."),
@@ -314,6 +315,7 @@ static const char *prepare_index(int argc, const char **argv, const char *prefix
 
 	if (read_cache_preload(&pathspec) < 0)
 		die(_("index file corrupt"));
+	expand_index_for_pathspec(&the_index, &pathspec);
 
 	if (interactive) {
 		char *old_index_env = NULL;
@@ -1345,6 +1347,7 @@ int cmd_status(int argc, const char **argv, const char *prefix)
 
 	enable_fscache(1);
 	read_cache_preload(&s.pathspec);
+	expand_index_for_pathspec(&the_index, &s.pathspec);
 	refresh_index(&the_index, REFRESH_QUIET|REFRESH_UNMERGED, &s.pathspec, NULL, NULL);
 
 	if (use_optional_locks())
@@ -15,7 +15,7 @@
 #include "packfile.h"
 
 static const char index_pack_usage[] =
-"git index-pack [-v] [-o <index-file>] [--keep | --keep=<msg>] [--verify] [--strict] (<pack-file> | --stdin [--fix-thin] [<pack-file>])";
+"git index-pack [-v] [-o <index-file>] [--keep | --keep=<msg>] [--[no-]rev-index] [--verify] [--strict] (<pack-file> | --stdin [--fix-thin] [<pack-file>])";
 
 struct object_entry {
 	struct pack_idx_entry idx;
@@ -144,6 +144,7 @@ static void init_thread(void)
 {
 	int i;
 	init_recursive_mutex(&read_mutex);
+	enable_obj_read_lock();
 	pthread_mutex_init(&counter_mutex, NULL);
 	pthread_mutex_init(&work_mutex, NULL);
 	pthread_mutex_init(&type_cas_mutex, NULL);
@@ -167,6 +168,7 @@ static void cleanup_thread(void)
 		return;
 	threads_active = 0;
 	pthread_mutex_destroy(&read_mutex);
+	disable_obj_read_lock();
 	pthread_mutex_destroy(&counter_mutex);
 	pthread_mutex_destroy(&work_mutex);
 	pthread_mutex_destroy(&type_cas_mutex);
@@ -793,31 +795,27 @@ static void sha1_object(const void *data, struct object_entry *obj_entry,
 
 	assert(data || obj_entry);
 
-	if (startup_info->have_repository) {
-		read_lock();
+	if (startup_info->have_repository)
 		collision_test_needed =
 			has_sha1_file_with_flags(oid->hash, OBJECT_INFO_QUICK);
-		read_unlock();
-	}
 
 	if (collision_test_needed && !data) {
-		read_lock();
+		/* Streaming from the object store is not thread-safe. */
+		obj_read_lock();
 		if (!check_collison(obj_entry))
 			collision_test_needed = 0;
-		read_unlock();
+		obj_read_unlock();
 	}
 	if (collision_test_needed) {
 		void *has_data;
 		enum object_type has_type;
 		unsigned long has_size;
-		read_lock();
 		has_type = sha1_object_info(oid->hash, &has_size);
 		if (has_type < 0)
 			die(_("cannot read existing object info %s"), oid_to_hex(oid));
 		if (has_type != type || has_size != size)
 			die(_("SHA1 COLLISION FOUND WITH %s !"), oid_to_hex(oid));
 		has_data = read_sha1_file(oid->hash, &has_type, &has_size);
-		read_unlock();
 		if (!data)
 			data = new_data = get_data_from_pack(obj_entry);
 		if (!has_data)
@@ -1437,12 +1435,14 @@ static void write_special_file(const char *suffix, const char *msg,
 
 static void final(const char *final_pack_name, const char *curr_pack_name,
 		  const char *final_index_name, const char *curr_index_name,
+		  const char *final_rev_name, const char *curr_rev_name,
 		  const char *keep_msg, const char *promisor_msg,
 		  unsigned char *hash)
 {
 	const char *report = "pack";
 	struct strbuf pack_name = STRBUF_INIT;
 	struct strbuf index_name = STRBUF_INIT;
+	struct strbuf rev_name = STRBUF_INIT;
 	int err;
 
 	if (!from_stdin) {
@@ -1469,6 +1469,16 @@ static void final(const char *final_pack_name, const char *curr_pack_name,
 	} else if (from_stdin)
 		chmod(final_pack_name, 0444);
 
+	if (curr_rev_name) {
+		if (final_rev_name != curr_rev_name) {
+			if (!final_rev_name)
+				final_rev_name = odb_pack_name(&rev_name, hash, "rev");
+			if (finalize_object_file(curr_rev_name, final_rev_name))
+				die(_("cannot store reverse index file"));
+		} else
+			chmod(final_rev_name, 0444);
+	}
+
 	if (final_index_name != curr_index_name) {
 		if (!final_index_name)
 			final_index_name = odb_pack_name(&index_name, hash, "idx");
@@ -1499,6 +1509,7 @@ static void final(const char *final_pack_name, const char *curr_pack_name,
 		}
 	}
 
+	strbuf_release(&rev_name);
 	strbuf_release(&index_name);
 	strbuf_release(&pack_name);
 }
@@ -1513,6 +1524,13 @@ static int git_index_pack_config(const char *k, const char *v, void *cb)
 			die(_("bad pack.indexversion=%"PRIu32), opts->version);
 		return 0;
 	}
+	if (!strcmp(k, "pack.writereverseindex")) {
+		if (git_config_bool(k, v))
+			opts->flags |= WRITE_REV;
+		else
+			opts->flags &= ~WRITE_REV;
+		return 0;
+	}
 	if (!strcmp(k, "pack.threads")) {
 		nr_threads = git_config_int(k, v);
 		if (nr_threads < 0)
@@ -1646,11 +1664,12 @@ static void show_pack_info(int stat_only)
 int cmd_index_pack(int argc, const char **argv, const char *prefix)
 {
 	int i, fix_thin_pack = 0, verify = 0, stat_only = 0;
-	const char *curr_index;
-	const char *index_name = NULL, *pack_name = NULL;
+	const char *curr_index, *curr_rev_index = NULL;
+	const char *index_name = NULL, *pack_name = NULL, *rev_index_name = NULL;
 	const char *keep_msg = NULL;
 	const char *promisor_msg = NULL;
 	struct strbuf index_name_buf = STRBUF_INIT;
+	struct strbuf rev_index_name_buf = STRBUF_INIT;
 	struct pack_idx_entry **idx_objects;
 	struct pack_idx_option opts;
 	unsigned char pack_hash[GIT_MAX_RAWSZ];
@@ -1691,6 +1710,10 @@ int cmd_index_pack(int argc, const char **argv, const char *prefix)
 				check_self_contained_and_connected = 1;
 			} else if (!strcmp(arg, "--fsck-objects")) {
 				do_fsck_object = 1;
+			} else if (!strcmp(arg, "--rev-index")) {
+				opts.flags |= WRITE_REV;
+			} else if (!strcmp(arg, "--no-rev-index")) {
+				opts.flags &= ~WRITE_REV;
 			} else if (!strcmp(arg, "--verify")) {
 				verify = 1;
 			} else if (!strcmp(arg, "--verify-stat")) {
@@ -1767,6 +1790,17 @@ int cmd_index_pack(int argc, const char **argv, const char *prefix)
 		die(_("--stdin requires a git repository"));
 	if (!index_name && pack_name)
 		index_name = derive_filename(pack_name, "idx", &index_name_buf);
+	if (verify)
+		opts.flags &= ~WRITE_REV;
+	if ((opts.flags & WRITE_REV) && index_name) {
+		size_t len;
+		if (!strip_suffix(index_name, ".idx", &len))
+			die(_("index file '%s' does not end with '.idx'"),
+			    index_name);
+		strbuf_add(&rev_index_name_buf, index_name, len);
+		strbuf_addstr(&rev_index_name_buf, ".rev");
+		rev_index_name = rev_index_name_buf.buf;
+	}
 
 	if (verify) {
 		if (!index_name)
@@ -1809,21 +1843,28 @@ int cmd_index_pack(int argc, const char **argv, const char *prefix)
 	for (i = 0; i < nr_objects; i++)
 		idx_objects[i] = &objects[i].idx;
 	curr_index = write_idx_file(index_name, idx_objects, nr_objects, &opts, pack_hash);
+	if (opts.flags & WRITE_REV)
+		curr_rev_index = write_rev_file(rev_index_name, idx_objects,
+						nr_objects, pack_hash);
 	free(idx_objects);
 
 	if (!verify)
 		final(pack_name, curr_pack,
 		      index_name, curr_index,
+		      rev_index_name, curr_rev_index,
 		      keep_msg, promisor_msg,
 		      pack_hash);
 	else
 		close(input_fd);
 	free(objects);
 	strbuf_release(&index_name_buf);
+	strbuf_release(&rev_index_name_buf);
 	if (pack_name == NULL)
 		free((void *) curr_pack);
 	if (index_name == NULL)
 		free((void *) curr_index);
+	if (rev_index_name == NULL)
+		free((void *) curr_rev_index);
 
 	/*
 	 * Let the caller know this pack is not self contained
@@ -9,10 +9,12 @@
 #include "string-list.h"
 #include "argv-array.h"
 #include "packfile.h"
+#include "midx.h"
 
 static int delta_base_offset = 1;
 static int pack_kept_objects = -1;
 static int write_bitmaps;
+static int use_delta_islands;
 static char *packdir, *packtmp;
 
 static const char *const git_repack_usage[] = {
@@ -21,8 +23,9 @@ static const char *const git_repack_usage[] = {
 };
 
 static const char incremental_bitmap_conflict_error[] = N_(
-"Incremental repacks are incompatible with bitmap indexes.  Use\n"
-"--no-write-bitmap-index or disable the pack.writebitmaps configuration."
+"Incremental repacks need an existing bitmap index to add a bitmap layer\n"
+"to.  Run a full repack with -a first, or use --no-write-bitmap-index or\n"
+"disable the pack.writebitmaps configuration."
 );
 
 
@@ -41,6 +44,10 @@ static int repack_config(const char *var, const char *value, void *cb)
 		write_bitmaps = git_config_bool(var, value);
 		return 0;
 	}
+	if (!strcmp(var, "repack.usedeltaislands")) {
+		use_delta_islands = git_config_bool(var, value);
+		return 0;
+	}
 	return git_default_config(var, value, cb);
 }
 
@@ -86,8 +93,12 @@ static void remove_pack_on_signal(int signo)
  * Adds all packs hex strings to the fname list, which do not
  * have a corresponding .keep or .promisor file. These packs are not to
  * be kept if we are going to pack everything into one file.
+ *
+ * With "skip_bitmapped", packs with a bitmap or a bitmap layer are not
+ * added either: they are kept when adding a new bitmap layer.
  */
-static void get_non_kept_pack_filenames(struct string_list *fname_list)
+static void get_non_kept_pack_filenames(struct string_list *fname_list,
+					int skip_bitmapped)
 {
 	DIR *dir;
 	struct dirent *e;
@@ -104,7 +115,10 @@ static void get_non_kept_pack_filenames(struct string_list *fname_list)
 		fname = xmemdupz(e->d_name, len);
 
 		if (!file_exists(mkpath("%s/%s.keep", packdir, fname)) &&
-		    !file_exists(mkpath("%s/%s.promisor", packdir, fname)))
+		    !file_exists(mkpath("%s/%s.promisor", packdir, fname)) &&
+		    (!skip_bitmapped ||
+		     (!file_exists(mkpath("%s/%s.bitmap", packdir, fname)) &&
+		      !file_exists(mkpath("%s/%s.bitmap-layer", packdir, fname)))))
 			string_list_append_nodup(fname_list, fname);
 		else
 			free(fname);
@@ -112,9 +126,24 @@ static void get_non_kept_pack_filenames(struct string_list *fname_list)
 	closedir(dir);
 }
 
+static int have_pack_bitmap(void)
+{
+	DIR *dir;
+	struct dirent *e;
+	int found = 0;
+
+	if (!(dir = opendir(packdir)))
+		return 0;
+
+	while (!found && (e = readdir(dir)) != NULL)
+		found = ends_with(e->d_name, ".bitmap");
+	closedir(dir);
+	return found;
+}
+
 static void remove_redundant_pack(const char *dir_name, const char *base_name)
 {
-	const char *exts[] = {".pack", ".idx", ".keep", ".bitmap"};
+	const char *exts[] = {".pack", ".idx", ".rev", ".keep", ".bitmap", ".bitmap-layer"};
 	int i;
 	struct strbuf buf = STRBUF_INIT;
 	size_t plen;
@@ -140,8 +169,10 @@ int cmd_repack(int argc, const char **argv, const char *prefix)
 		unsigned optional:1;
 	} exts[] = {
 		{".pack"},
+		{".rev", 1},
 		{".idx"},
 		{".bitmap", 1},
+		{".bitmap-layer", 1},
 	};
 	struct child_process cmd = CHILD_PROCESS_INIT;
 	struct string_list_item *item;
@@ -165,6 +196,7 @@ int cmd_repack(int argc, const char **argv, const char *prefix)
 	int no_update_server_info = 0;
 	int quiet = 0;
 	int local = 0;
+	int bitmap_layer = 0;
 
 	struct option builtin_repack_options[] = {
 		OPT_BIT('a', NULL, &pack_everything,
@@ -185,6 +217,8 @@ int cmd_repack(int argc, const char **argv, const char *prefix)
 				N_("pass --local to git-pack-objects")),
 		OPT_BOOL('b', "write-bitmap-index", &write_bitmaps,
 				N_("write bitmap index")),
+		OPT_BOOL('i', "delta-islands", &use_delta_islands,
+				N_("pass --delta-islands to git-pack-objects")),
 		OPT_STRING(0, "unpack-unreachable", &unpack_unreachable, N_("approxidate"),
 				N_("with -A, do not loosen objects older than this")),
 		OPT_BOOL('k', "keep-unreachable", &keep_unreachable,
@@ -219,12 +253,20 @@ int cmd_repack(int argc, const char **argv, const char *prefix)
 	if (pack_kept_objects < 0)
 		pack_kept_objects = write_bitmaps;
 
-	if (write_bitmaps && !(pack_everything & ALL_INTO_ONE))
-		die(_(incremental_bitmap_conflict_error));
-
 	packdir = mkpathdup("%s/pack", get_object_directory());
 	packtmp = mkpathdup("%s/.tmp-%d-pack", packdir, (int)getpid());
 
+	/*
+	 * An incremental repack with bitmaps packs everything that is not
+	 * covered by the existing bitmaps into a new pack with a bitmap
+	 * layer on top of them.
+	 */
+	if (write_bitmaps && !(pack_everything & ALL_INTO_ONE)) {
+		if (!have_pack_bitmap())
+			die(_(incremental_bitmap_conflict_error));
+		bitmap_layer = 1;
+	}
+
 	sigchain_push_common(remove_pack_on_signal);
 
 	argv_array_push(&cmd.args, "pack-objects");
@@ -253,9 +295,11 @@ int cmd_repack(int argc, const char **argv, const char *prefix)
 		argv_array_pushf(&cmd.args, "--no-reuse-object");
 	if (write_bitmaps)
 		argv_array_push(&cmd.args, "--write-bitmap-index");
+	if (use_delta_islands)
+		argv_array_push(&cmd.args, "--delta-islands");
 
 	if (pack_everything & ALL_INTO_ONE) {
-		get_non_kept_pack_filenames(&existing_packs);
+		get_non_kept_pack_filenames(&existing_packs, 0);
 
 		if (existing_packs.nr && delete_redundant) {
 			if (unpack_unreachable) {
@@ -273,6 +317,11 @@ int cmd_repack(int argc, const char **argv, const char *prefix)
 				argv_array_push(&cmd.env_array, "GIT_REF_PARANOIA=1");
 			}
 		}
+	} else if (bitmap_layer) {
+		argv_array_push(&cmd.args, "--bitmap-layer");
+		get_non_kept_pack_filenames(&existing_packs, 1);
+		if (existing_packs.nr && delete_redundant)
+			argv_array_push(&cmd.env_array, "GIT_REF_PARANOIA=1");
 	} else {
 		argv_array_push(&cmd.args, "--unpacked");
 		argv_array_push(&cmd.args, "--incremental");
@@ -434,6 +483,17 @@ int cmd_repack(int argc, const char **argv, const char *prefix)
 		prune_packed_objects(opts);
 	}
 
+	/*
+	 * Keep an existing multi-pack-index in sync with the packs we
+	 * just added and removed.
+	 */
+	if (names.nr || delete_redundant) {
+		char *midx_name = get_midx_filename(get_object_directory());
+		if (file_exists(midx_name))
+			write_midx_file(get_object_directory());
+		free(midx_name);
+	}
+
 	if (!no_update_server_info)
 		update_server_info(0);
 	remove_temporary_files();
@@ -26,6 +26,7 @@
 #include "submodule-config.h"
 #include "strbuf.h"
 #include "quote.h"
+#include "sparse-index.h"
 
 static const char * const git_reset_usage[] = {
 	N_("git reset [--mixed | --soft | --hard | --merge | --keep] [-q] [<commit>]"),
@@ -356,6 +357,8 @@ int cmd_reset(int argc, const char **argv, const char *prefix)
 	} else if (nul_term_line)
 		die(_("-z requires --stdin"));
 
+	expand_index_for_pathspec(&the_index, &pathspec);
+
 	unborn = !strcmp(rev, "HEAD") && get_oid("HEAD", &oid);
 	if (unborn) {
 		/* reset on unborn branch: treat as reset to empty tree */
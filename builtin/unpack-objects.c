@@ -12,9 +12,11 @@
 #include "progress.h"
 #include "decorate.h"
 #include "fsck.h"
+#include "thread-utils.h"
 
 static int dry_run, quiet, recover, has_errors, strict;
-static const char unpack_usage[] = "git unpack-objects [-n] [-q] [-r] [--strict]";
+static int nr_threads;
+static const char unpack_usage[] = "git unpack-objects [-n] [-q] [-r] [--strict] [--threads=<n>]";
 
 /* We always read in 4kB chunks. */
 static unsigned char buffer[4096];
@@ -173,8 +175,8 @@ static void write_cached_object(struct object *obj, struct obj_buffer *obj_buf)
 {
 	struct object_id oid;
 
-	if (write_object_file(obj_buf->buffer, obj_buf->size,
-			      type_name(obj->type), &oid) < 0)
+	if (write_object_file_async(obj_buf->buffer, obj_buf->size,
+				    type_name(obj->type), &oid) < 0)
 		die("failed to write object %s", oid_to_hex(&obj->oid));
 	obj->flags |= FLAG_WRITTEN;
 }
@@ -239,16 +241,16 @@ static void write_object(unsigned nr, enum object_type type,
 			 void *buf, unsigned long size)
 {
 	if (!strict) {
-		if (write_object_file(buf, size, type_name(type),
-				      &obj_list[nr].oid) < 0)
+		if (write_object_file_async(buf, size, type_name(type),
+					    &obj_list[nr].oid) < 0)
 			die("failed to write object");
 		added_object(nr, type, buf, size);
 		free(buf);
 		obj_list[nr].obj = NULL;
 	} else if (type == OBJ_BLOB) {
 		struct blob *blob;
-		if (write_object_file(buf, size, type_name(type),
-				      &obj_list[nr].oid) < 0)
+		if (write_object_file_async(buf, size, type_name(type),
+					    &obj_list[nr].oid) < 0)
 			die("failed to write object");
 		added_object(nr, type, buf, size);
 		free(buf);
@@ -507,6 +509,23 @@ static void unpack_all(void)
 		die("unresolved deltas left after unpacking");
 }
 
+static int git_unpack_objects_config(const char *k, const char *v, void *cb)
+{
+	if (!strcmp(k, "pack.threads")) {
+		nr_threads = git_config_int(k, v);
+		if (nr_threads < 0)
+			die(_("invalid number of threads specified (%d)"),
+			    nr_threads);
+#ifdef NO_PTHREADS
+		if (nr_threads != 1)
+			warning(_("no threads support, ignoring %s"), k);
+		nr_threads = 1;
+#endif
+		return 0;
+	}
+	return git_default_config(k, v, cb);
+}
+
 int cmd_unpack_objects(int argc, const char **argv, const char *prefix)
 {
 	int i;
@@ -514,7 +533,7 @@ int cmd_unpack_objects(int argc, const char **argv, const char *prefix)
 
 	check_replace_refs = 0;
 
-	git_config(git_default_config, NULL);
+	git_config(git_unpack_objects_config, NULL);
 
 	quiet = !isatty(2);
 
@@ -562,18 +581,43 @@ int cmd_unpack_objects(int argc, const char **argv, const char *prefix)
 				max_input_size = strtoumax(arg, NULL, 10);
 				continue;
 			}
+			if (skip_prefix(arg, "--threads=", &arg)) {
+				char *end;
+				nr_threads = strtoul(arg, &end, 0);
+				if (!*arg || *end || nr_threads < 0)
+					usage(unpack_usage);
+#ifdef NO_PTHREADS
+				if (nr_threads != 1)
+					warning(_("no threads support, ignoring --threads"));
+				nr_threads = 1;
+#endif
+				continue;
+			}
 			usage(unpack_usage);
 		}
 
 		/* We don't take any non-flag arguments now.. Maybe some day */
 		usage(unpack_usage);
 	}
+#ifndef NO_PTHREADS
+	if (!nr_threads) {
+		nr_threads = online_cpus();
+		/* beyond a few writers, the disk is the bottleneck */
+		if (nr_threads > 3)
+			nr_threads = 3;
+	}
+#endif
+	if (!dry_run)
+		start_async_object_writes(nr_threads);
+
 	the_hash_algo->init_fn(&ctx);
 	unpack_all();
 	the_hash_algo->update_fn(&ctx, buffer, offset);
 	the_hash_algo->final_fn(oid.hash, &ctx);
 	if (strict)
 		write_rest();
+	if (finish_async_object_writes())
+		die("failed to write object");
 	if (hashcmp(fill(the_hash_algo->rawsz), oid.hash))
 		die("final sha1 did not match");
 	use(the_hash_algo->rawsz);
@@ -42,7 +42,7 @@ static int subtree_name_cmp(const char *one, int onelen,
 	return memcmp(one, two, onelen);
 }
 
-static int subtree_pos(struct cache_tree *it, const char *path, int pathlen)
+int cache_tree_subtree_pos(struct cache_tree *it, const char *path, int pathlen)
 {
 	struct cache_tree_sub **down = it->down;
 	int lo, hi;
@@ -69,7 +69,7 @@ static struct cache_tree_sub *find_subtree(struct cache_tree *it,
 					   int create)
 {
 	struct cache_tree_sub *down;
-	int pos = subtree_pos(it, path, pathlen);
+	int pos = cache_tree_subtree_pos(it, path, pathlen);
 	if (0 <= pos)
 		return it->down[pos];
 	if (!create)
@@ -120,7 +120,7 @@ static int do_invalidate_path(struct cache_tree *it, const char *path)
 	it->entry_count = -1;
 	if (!*slash) {
 		int pos;
-		pos = subtree_pos(it, path, namelen);
+		pos = cache_tree_subtree_pos(it, path, namelen);
 		if (0 <= pos) {
 			cache_tree_free(&it->down[pos]->cache_tree);
 			free(it->down[pos]);
@@ -254,6 +254,21 @@ static int update_one(struct cache_tree *it,
 	if (0 <= it->entry_count && has_sha1_file(it->oid.hash))
 		return it->entry_count;
 
+	/*
+	 * A sparse directory entry stands for the whole tree at this
+	 * level; there is nothing below it to look at.
+	 */
+	if (entries && S_ISSPARSEDIR(cache[0]->ce_mode) &&
+	    ce_namelen(cache[0]) == baselen &&
+	    !memcmp(cache[0]->name, base, baselen)) {
+		for (i = 0; i < it->subtree_nr; i++)
+			it->down[i]->used = 0;
+		discard_unused_subtrees(it);
+		oidcpy(&it->oid, &cache[0]->oid);
+		it->entry_count = 1;
+		return 1;
+	}
+
 	/*
 	 * We first scan for subtrees and update them; we start by
 	 * marking existing subtrees -- the ones that are unmarked
@@ -655,11 +670,28 @@ int write_cache_as_tree(unsigned char *sha1, int flags, const char *prefix)
 	return write_index_as_tree(sha1, &the_index, get_index_file(), flags, prefix);
 }
 
-static void prime_cache_tree_rec(struct cache_tree *it, struct tree *tree)
+/*
+ * A sparse index has a single entry for each of its sparse directories,
+ * which "istate" is used to look up; it may be NULL for a full index.
+ */
+static int is_sparse_dir(struct index_state *istate, struct strbuf *path)
+{
+	int pos;
+
+	if (!istate || !istate->sparse_index)
+		return 0;
+	pos = index_name_pos(istate, path->buf, path->len);
+	return pos >= 0 && S_ISSPARSEDIR(istate->cache[pos]->ce_mode);
+}
+
+static void prime_cache_tree_rec(struct index_state *istate,
+				 struct cache_tree *it, struct tree *tree,
+				 struct strbuf *path)
 {
 	struct tree_desc desc;
 	struct name_entry entry;
 	int cnt;
+	size_t baselen = path->len;
 
 	oidcpy(&it->oid, &tree->object.oid);
 	init_tree_desc(&desc, tree->buffer, tree->size);
@@ -669,12 +701,22 @@ static void prime_cache_tree_rec(struct cache_tree *it, struct tree *tree)
 			cnt++;
 		else {
 			struct cache_tree_sub *sub;
-			struct tree *subtree = lookup_tree(entry.oid);
-			if (!subtree->object.parsed)
-				parse_tree(subtree);
+			struct tree *subtree;
+
 			sub = cache_tree_sub(it, entry.path);
 			sub->cache_tree = cache_tree();
-			prime_cache_tree_rec(sub->cache_tree, subtree);
+			strbuf_addf(path, "%s/", entry.path);
+			if (is_sparse_dir(istate, path)) {
+				oidcpy(&sub->cache_tree->oid, entry.oid);
+				sub->cache_tree->entry_count = 1;
+			} else {
+				subtree = lookup_tree(entry.oid);
+				if (!subtree->object.parsed)
+					parse_tree(subtree);
+				prime_cache_tree_rec(istate, sub->cache_tree,
+						     subtree, path);
+			}
+			strbuf_setlen(path, baselen);
 			cnt += sub->cache_tree->entry_count;
 		}
 	}
@@ -683,12 +725,62 @@ static void prime_cache_tree_rec(struct cache_tree *it, struct tree *tree)
 
 void prime_cache_tree(struct index_state *istate, struct tree *tree)
 {
+	struct strbuf path = STRBUF_INIT;
+
 	cache_tree_free(&istate->cache_tree);
 	istate->cache_tree = cache_tree();
-	prime_cache_tree_rec(istate->cache_tree, tree);
+	prime_cache_tree_rec(istate, istate->cache_tree, tree, &path);
+	strbuf_release(&path);
 	istate->cache_changed |= CACHE_TREE_CHANGED;
 }
 
+void cache_tree_expand_sparse_dir(struct index_state *istate,
+				  const char *path, struct tree *tree)
+{
+	struct cache_tree *it = istate->cache_tree;
+	struct strbuf buf = STRBUF_INIT;
+	const char *slash;
+	int i, delta;
+
+	if (!it)
+		return;
+	for (slash = path; *slash; slash++) {
+		struct cache_tree_sub *sub;
+		const char *name = slash;
+
+		slash = strchr(name, '/');
+		sub = find_subtree(it, name, slash - name, 0);
+		if (!sub || !sub->cache_tree) {
+			cache_tree_invalidate_path(istate, path);
+			return;
+		}
+		it = sub->cache_tree;
+	}
+
+	if (it->entry_count < 0 || oidcmp(&it->oid, &tree->object.oid)) {
+		cache_tree_invalidate_path(istate, path);
+		return;
+	}
+	for (i = 0; i < it->subtree_nr; i++)
+		it->down[i]->used = 0;
+	discard_unused_subtrees(it);
+	delta = -it->entry_count;
+	prime_cache_tree_rec(NULL, it, tree, &buf);
+	strbuf_release(&buf);
+	delta += it->entry_count;
+
+	/* the directories above it have grown by as many entries */
+	it = istate->cache_tree;
+	for (slash = path; *slash; slash++) {
+		const char *name = slash;
+
+		if (it->entry_count >= 0)
+			it->entry_count += delta;
+		slash = strchr(name, '/');
+		it = find_subtree(it, name, slash - name, 0)->cache_tree;
+	}
+}
+
 /*
  * find the cache_tree that corresponds to the current level without
  * exploding the full path into textual form.  The root of the
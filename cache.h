@@ -81,6 +81,13 @@ struct object_id {
 #define S_IFGITLINK	0160000
 #define S_ISGITLINK(m)	(((m) & S_IFMT) == S_IFGITLINK)
 
+/*
+ * A sparse index (see sparse-index.h) records a directory outside of the
+ * sparse checkout as a single entry with this mode, whose name ends with
+ * a slash and whose object name is that of the tree.
+ */
+#define S_ISSPARSEDIR(m)	((m) == S_IFDIR)
+
 /*
  * Some mode bits are also used internally for computations.
  *
@@ -321,10 +328,12 @@ struct index_state {
 	struct cache_time timestamp;
 	unsigned name_hash_initialized : 1,
 		 initialized : 1,
-		 drop_cache_tree : 1;
+		 drop_cache_tree : 1,
+		 sparse_index : 1;
 	struct hashmap name_hash;
 	struct hashmap dir_hash;
 	unsigned char sha1[20];
+	unsigned char sparse_checkout_sha1[20];
 	struct untracked_cache *untracked;
 	uint64_t fsmonitor_last_update;
 	struct ewah_bitmap *fsmonitor_dirty;
@@ -624,6 +633,15 @@ extern int read_index_unmerged(struct index_state *);
  */
 extern int write_locked_index(struct index_state *, struct lock_file *lock, unsigned flags);
 
+/*
+ * Push the entries of a split index that has grown past
+ * splitIndex.maxPercentChange back to a new shared index.  The shared
+ * index is written without holding the index lock, which is only taken
+ * to switch the split index over to it; nothing is done if the index
+ * was changed by somebody else in the meantime.
+ */
+extern int compact_split_index(struct index_state *);
+
 extern int discard_index(struct index_state *);
 extern void move_index_extensions(struct index_state *dst, struct index_state *src);
 extern int unmerged_index(const struct index_state *);
@@ -808,6 +826,8 @@ extern char *git_replace_ref_base;
 extern int fsync_object_files;
 extern int core_preload_index;
 extern int core_apply_sparse_checkout;
+extern int core_commit_graph;
+extern int core_multi_pack_index;
 extern int precomposed_unicode;
 extern int protect_hfs;
 extern int protect_ntfs;
@@ -1191,6 +1211,28 @@ static inline void *read_sha1_file(const unsigned char *sha1, enum object_type *
 	return read_sha1_file_extended(sha1, type, size, 1);
 }
 
+/*
+ * Read many objects at once. The caller fills in "oid" of each request;
+ * read_object_batch() sets "buf", "type" and "size" of every request as
+ * read_sha1_file() would, leaving "buf" NULL for missing objects.
+ *
+ * The objects are read in the order in which they are stored in their
+ * packs, by up to "nr_threads" threads. This must not be called while
+ * the object read lock is enabled.
+ */
+struct object_read_request {
+	struct object_id oid;
+	void *buf;
+	enum object_type type;
+	unsigned long size;
+
+	/* private */
+	struct packed_git *pack;
+	off_t offset;
+};
+extern void read_object_batch(struct object_read_request *req, size_t nr,
+			      int nr_threads);
+
 /*
  * This internal function is only declared here for the benefit of
  * lookup_replace_object().  Please do not call it directly.
@@ -1210,6 +1252,12 @@ static inline const unsigned char *lookup_replace_object(const unsigned char *sh
 	return do_lookup_replace_object(sha1);
 }
 
+/*
+ * Returns non-zero if replace references are honored in this run and
+ * at least one of them exists.
+ */
+extern int has_replace_objects(void);
+
 /* Read and unpack a sha1 file into memory, write memory to a sha1 file */
 extern int sha1_object_info(const unsigned char *, unsigned long *);
 
@@ -1219,6 +1267,23 @@ extern int hash_object_file(const void *buf, unsigned long len,
 extern int write_object_file(const void *buf, unsigned long len,
 			     const char *type, struct object_id *oid);
 
+/*
+ * Between start_async_object_writes() and finish_async_object_writes(),
+ * write_object_file_async() computes the name of the object and hands a
+ * copy of it to one of "nr_threads" threads, which compress and write
+ * the loose object. Objects that are not written yet are still found by
+ * has_sha1_file(), sha1_object_info() and read_sha1_file().
+ *
+ * Without a started pool (or with "nr_threads" of 1),
+ * write_object_file_async() is write_object_file(). Errors of the
+ * writer threads are reported by finish_async_object_writes(), which
+ * returns -1 if any object could not be written.
+ */
+extern void start_async_object_writes(int nr_threads);
+extern int write_object_file_async(const void *buf, unsigned long len,
+				   const char *type, struct object_id *oid);
+extern int finish_async_object_writes(void);
+
 extern int hash_object_file_literally(const void *buf, unsigned long len,
 				      const char *type, struct object_id *oid,
 				      unsigned flags);
@@ -1527,6 +1592,7 @@ struct checkout {
 	const char *base_dir;
 	int base_dir_len;
 	struct delayed_checkout *delayed_checkout;
+	struct parallel_checkout *parallel_checkout;
 	unsigned force:1,
 		 quiet:1,
 		 not_new:1,
@@ -1538,6 +1604,8 @@ struct checkout {
 extern int checkout_entry(struct cache_entry *ce, const struct checkout *state, char *topath);
 extern void enable_delayed_checkout(struct checkout *state);
 extern int finish_delayed_checkout(struct checkout *state);
+extern void update_ce_after_write(const struct checkout *state,
+				 struct cache_entry *ce, struct stat *st);
 
 struct cache_def {
 	struct strbuf path;
@@ -1631,13 +1699,18 @@ extern struct packed_git {
 	int index_version;
 	time_t mtime;
 	int pack_fd;
+	int index;		/* for builtin/pack-objects.c */
 	unsigned pack_local:1,
 		 pack_keep:1,
 		 freshened:1,
 		 do_not_close:1,
-		 pack_promisor:1;
+		 pack_promisor:1,
+		 multi_pack_index:1;
 	unsigned char sha1[20];
 	struct revindex_entry *revindex;
+	const void *revindex_map;
+	size_t revindex_size;
+	const uint32_t *revindex_data;
 	/* something like ".git/objects/pack/xxxxx.pack" */
 	char pack_name[FLEX_ARRAY]; /* more */
 } *packed_git;
@@ -1773,6 +1846,22 @@ struct object_info {
 #define OBJECT_INFO_QUICK 8
 extern int sha1_object_info_extended(const unsigned char *, struct object_info *, unsigned flags);
 
+/*
+ * Enabling the object read lock allows multiple threads to call
+ * read_sha1_file(), read_sha1_file_extended(), sha1_object_info(),
+ * sha1_object_info_extended() and has_sha1_file() in parallel. The lock
+ * is dropped while objects are inflated and deltas are applied, so
+ * those threads do most of their work concurrently.
+ *
+ * Other accesses to the object store (e.g. to the list of packs or to
+ * the alternates) from such threads must hold obj_read_lock(), which
+ * is recursive and does nothing unless the lock is enabled.
+ */
+extern void enable_obj_read_lock(void);
+extern void disable_obj_read_lock(void);
+extern void obj_read_lock(void);
+extern void obj_read_unlock(void);
+
 /*
  * Set this to 0 to prevent sha1_object_info_extended() from fetching missing
  * blobs. This has a difference only if extensions.partialClone is set.
@@ -1810,6 +1899,11 @@ extern void fprintf_or_die(FILE *, const char *fmt, ...);
 #define COPY_READ_ERROR (-2)
 #define COPY_WRITE_ERROR (-3)
 extern int copy_fd(int ifd, int ofd);
+/*
+ * Copy "len" bytes of "ifd" starting at "offset" to "ofd", without
+ * going through a userspace buffer where the platform allows it.
+ */
+extern int copy_fd_range(int ifd, int ofd, off_t offset, off_t len);
 extern int copy_file(const char *dst, const char *src, int mode);
 extern int copy_file_with_time(const char *dst, const char *src, int mode);
 
@@ -1859,6 +1953,7 @@ int decode_85(char *dst, const char *line, int linelen);
 void encode_85(char *buf, const unsigned char *data, int bytes);
 
 /* alloc.c */
+struct commit;
 extern void *alloc_blob_node(void);
 extern void *alloc_tree_node(void);
 extern void *alloc_commit_node(void);
@@ -1866,6 +1961,7 @@ extern void *alloc_tag_node(void);
 extern void *alloc_object_node(void);
 extern void alloc_report(void);
 extern unsigned int alloc_commit_index(void);
+extern void init_commit_node(struct commit *c);
 
 /* pkt-line.c */
 void packet_trace_identity(const char *prog);
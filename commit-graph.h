@@ -0,0 +1,67 @@
+#ifndef COMMIT_GRAPH_H
+#define COMMIT_GRAPH_H
+
+#include "git-compat-util.h"
+
+struct commit;
+
+char *get_commit_graph_filename(const char *obj_dir);
+
+/*
+ * Given a commit struct, try to fill the commit struct info, including:
+ *  1. tree object
+ *  2. date
+ *  3. parents.
+ *
+ * Returns 1 if and only if the commit was found in the packed graph.
+ *
+ * See parse_commit_buffer() for the fallback after this call.
+ */
+int parse_commit_in_graph(struct commit *item);
+
+/*
+ * The commit may have been parsed from its object buffer even though it
+ * is present in the commit-graph (e.g. through parse_object()). Fill in
+ * the graph position and generation number so that walks over it can
+ * still benefit from the graph.
+ */
+void load_commit_graph_info(struct commit *item);
+
+struct commit_graph {
+	const unsigned char *data;
+	size_t data_len;
+
+	unsigned char hash_len;
+	unsigned char num_chunks;
+	uint32_t num_commits;
+	struct object_id oid;
+
+	const uint32_t *chunk_oid_fanout;
+	const unsigned char *chunk_oid_lookup;
+	const unsigned char *chunk_commit_data;
+	const unsigned char *chunk_large_edges;
+};
+
+struct commit_graph *load_commit_graph_one(const char *graph_file);
+void free_commit_graph(struct commit_graph *g);
+
+/*
+ * Unmap the commit-graph loaded for the current repository. It is not
+ * consulted again for the rest of the process.
+ */
+void close_commit_graph(void);
+
+void write_commit_graph(const char *obj_dir,
+			const char **pack_indexes,
+			int nr_packs,
+			const char **commit_hex,
+			int nr_commits,
+			int append);
+
+/*
+ * Write a commit-graph covering every commit reachable from the refs
+ * of the current repository.
+ */
+void write_commit_graph_reachable(const char *obj_dir, int append);
+
+#endif
@@ -54,6 +54,34 @@ struct delayed_checkout {
 	struct string_list paths;
 };
 
+enum crlf_action {
+	CRLF_UNDEFINED,
+	CRLF_BINARY,
+	CRLF_TEXT,
+	CRLF_TEXT_INPUT,
+	CRLF_TEXT_CRLF,
+	CRLF_AUTO,
+	CRLF_AUTO_INPUT,
+	CRLF_AUTO_CRLF
+};
+
+struct convert_driver;
+
+/*
+ * The conversion-related attributes of a path, as looked up by
+ * convert_attrs().  Looking them up is not thread-safe, but the
+ * conversions driven by an already filled-in structure without a
+ * filter driver are.
+ */
+struct conv_attrs {
+	struct convert_driver *drv;
+	enum crlf_action attr_action; /* What attr says */
+	enum crlf_action crlf_action; /* When no attr is set, use core.autocrlf */
+	int ident;
+};
+
+extern void convert_attrs(struct conv_attrs *ca, const char *path);
+
 extern enum eol core_eol;
 extern const char *get_cached_convert_stats_ascii(const struct index_state *istate,
 						  const char *path);
@@ -66,6 +94,9 @@ extern int convert_to_git(const struct index_state *istate,
 			  struct strbuf *dst, int conv_flags);
 extern int convert_to_working_tree(const char *path, const char *src,
 				   size_t len, struct strbuf *dst);
+extern int convert_to_working_tree_ca(const struct conv_attrs *ca,
+				      const char *path, const char *src,
+				      size_t len, struct strbuf *dst);
 extern int async_convert_to_working_tree(const char *path, const char *src,
 					 size_t len, struct strbuf *dst,
 					 void *dco);
@@ -15,6 +15,43 @@ int copy_fd(int ifd, int ofd)
 	return 0;
 }
 
+#define SENDFILE_CHUNK (8 * 1024 * 1024)
+
+int copy_fd_range(int ifd, int ofd, off_t offset, off_t len)
+{
+#ifdef HAVE_SENDFILE
+	while (len) {
+		ssize_t ret = sendfile(ofd, ifd, &offset,
+				       len < SENDFILE_CHUNK ? len : SENDFILE_CHUNK);
+		if (ret < 0) {
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+			if (errno == EINVAL || errno == ENOSYS)
+				break; /* not supported for these fds */
+			return COPY_WRITE_ERROR;
+		}
+		if (!ret)
+			return COPY_READ_ERROR;
+		len -= ret;
+	}
+	if (!len)
+		return 0;
+#endif
+	if (lseek(ifd, offset, SEEK_SET) < 0)
+		return COPY_READ_ERROR;
+	while (len) {
+		char buffer[8192];
+		ssize_t ret = xread(ifd, buffer,
+				    len < sizeof(buffer) ? len : sizeof(buffer));
+		if (ret <= 0)
+			return COPY_READ_ERROR;
+		if (write_in_full(ofd, buffer, ret) < 0)
+			return COPY_WRITE_ERROR;
+		len -= ret;
+	}
+	return 0;
+}
+
 static int copy_times(const char *dst, const char *src)
 {
 	struct stat st;
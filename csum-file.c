@@ -61,9 +61,10 @@ int hashclose(struct hashfile *f, unsigned char *result, unsigned int flags)
 	the_hash_algo->final_fn(f->buffer, &f->ctx);
 	if (result)
 		hashcpy(result, f->buffer);
-	if (flags & (CSUM_CLOSE | CSUM_FSYNC)) {
-		/* write checksum and close fd */
+	if (flags & (CSUM_CLOSE | CSUM_FSYNC | CSUM_HASH_IN_STREAM))
 		flush(f, f->buffer, the_hash_algo->rawsz);
+	if (flags & (CSUM_CLOSE | CSUM_FSYNC)) {
+		/* checksum has been written; now close fd */
 		if (flags & CSUM_FSYNC)
 			fsync_or_die(f->fd, f->name);
 		if (close(f->fd))
@@ -0,0 +1,48 @@
+#ifndef DELTA_ISLANDS_H
+#define DELTA_ISLANDS_H
+
+struct commit;
+struct object_id;
+struct packing_data;
+
+/*
+ * Delta islands restrict the choice of delta bases in pack-objects so
+ * that an object is only stored as a delta against a base that is
+ * reachable from every island the object itself is reachable from.
+ * Islands are groups of refs defined by the "pack.island" regexes;
+ * see Documentation/git-pack-objects.txt.
+ */
+
+/*
+ * Return 1 if the object "trg_oid" may be stored as a delta against
+ * "src_oid", 0 otherwise. Always 1 when islands are not in use.
+ */
+int in_same_island(const struct object_id *trg_oid, const struct object_id *src_oid);
+
+/*
+ * Order two objects so that the one which can serve as a delta base
+ * for the other (because it is in a superset of its islands) sorts
+ * first in the delta search window.
+ */
+int island_delta_cmp(const struct object_id *a, const struct object_id *b);
+
+/*
+ * Pass the island marks of the trees in "to_pack" down to their
+ * entries; must be called once all objects have been added.
+ */
+void resolve_tree_islands(int progress, struct packing_data *to_pack);
+
+/*
+ * Read the island definitions from the config and mark the tips of
+ * every island.
+ */
+void load_delta_islands(int progress);
+
+/*
+ * Pass the island marks of "commit" to its root tree and its parents.
+ * Commits must be fed in an order where children come before their
+ * parents, e.g. by walking with --topo-order.
+ */
+void propagate_island_marks(struct commit *commit);
+
+#endif /* DELTA_ISLANDS_H */
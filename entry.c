@@ -5,6 +5,7 @@
 #include "submodule.h"
 #include "progress.h"
 #include "fsmonitor.h"
+#include "parallel-checkout.h"
 
 static void create_directories(const char *path, int path_len,
 			       const struct checkout *state)
@@ -250,6 +251,16 @@ int finish_delayed_checkout(struct checkout *state)
 	return errs;
 }
 
+void update_ce_after_write(const struct checkout *state,
+			  struct cache_entry *ce, struct stat *st)
+{
+	assert(state->istate);
+	fill_stat_cache_info(ce, st);
+	ce->ce_flags |= CE_UPDATE_IN_BASE;
+	mark_fsmonitor_invalid(state->istate, ce);
+	state->istate->cache_changed |= CE_ENTRY_CHANGED;
+}
+
 static int write_entry(struct cache_entry *ce,
 		       char *path, const struct checkout *state, int to_tempfile)
 {
@@ -370,15 +381,11 @@ static int write_entry(struct cache_entry *ce,
 	flush_fscache();
 
 	if (state->refresh_cache) {
-		assert(state->istate);
 		if (!fstat_done)
 			if (lstat(ce->name, &st) < 0)
 				return error_errno("unable to stat just-written file %s",
 						   ce->name);
-		fill_stat_cache_info(ce, &st);
-		ce->ce_flags |= CE_UPDATE_IN_BASE;
-		mark_fsmonitor_invalid(state->istate, ce);
-		state->istate->cache_changed |= CE_ENTRY_CHANGED;
+		update_ce_after_write(state, ce, &st);
 	}
 delayed:
 	return 0;
@@ -476,5 +483,7 @@ int checkout_entry(struct cache_entry *ce,
 		return 0;
 
 	create_directories(path.buf, path.len, state);
+	if (!enqueue_checkout(state, ce, path.buf))
+		return 0;
 	return write_entry(ce, path.buf, state, 0);
 }
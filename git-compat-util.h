@@ -197,6 +197,9 @@
 #ifdef HAVE_BSD_SYSCTL
 #include <sys/sysctl.h>
 #endif
+#ifdef HAVE_SENDFILE
+#include <sys/sendfile.h>
+#endif
 
 #if defined(__CYGWIN__)
 #include "compat/cygwin.h"
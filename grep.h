@@ -224,23 +224,15 @@ extern int grep_threads_ok(const struct grep_opt *opt);
  */
 extern int grep_use_locks;
 extern pthread_mutex_t grep_attr_mutex;
-extern pthread_mutex_t grep_read_mutex;
-
-static inline void grep_read_lock(void)
-{
-	if (grep_use_locks)
-		pthread_mutex_lock(&grep_read_mutex);
-}
-
-static inline void grep_read_unlock(void)
-{
-	if (grep_use_locks)
-		pthread_mutex_unlock(&grep_read_mutex);
-}
-
-#else
-#define grep_read_lock()
-#define grep_read_unlock()
 #endif
 
+/*
+ * Reading objects is thread-safe once the object read lock is enabled,
+ * but other accesses to the object store (e.g. adding alternates, or
+ * textconv which may read objects and writes temporary files) still
+ * need to be serialized.
+ */
+#define grep_read_lock() obj_read_lock()
+#define grep_read_unlock() obj_read_unlock()
+
 #endif
@@ -0,0 +1,1014 @@
+#include "cache.h"
+#include "config.h"
+#include "csum-file.h"
+#include "dir.h"
+#include "lockfile.h"
+#include "packfile.h"
+#include "sha1-lookup.h"
+#include "midx.h"
+
+#define MIDX_SIGNATURE 0x4d494458 /* "MIDX" */
+#define MIDX_VERSION 1
+#define MIDX_BYTE_FILE_VERSION 4
+#define MIDX_BYTE_HASH_VERSION 5
+#define MIDX_BYTE_NUM_CHUNKS 6
+#define MIDX_BYTE_NUM_PACKS 8
+#define MIDX_HASH_VERSION 1
+#define MIDX_HEADER_SIZE 12
+#define MIDX_HASH_LEN 20
+#define MIDX_MIN_SIZE (MIDX_HEADER_SIZE + MIDX_HASH_LEN)
+
+#define MIDX_MAX_CHUNKS 5
+#define MIDX_CHUNK_ALIGNMENT 4
+#define MIDX_CHUNKID_PACKNAMES 0x504e414d /* "PNAM" */
+#define MIDX_CHUNKID_OIDFANOUT 0x4f494446 /* "OIDF" */
+#define MIDX_CHUNKID_OIDLOOKUP 0x4f49444c /* "OIDL" */
+#define MIDX_CHUNKID_OBJECTOFFSETS 0x4f4f4646 /* "OOFF" */
+#define MIDX_CHUNKID_LARGEOFFSETS 0x4c4f4646 /* "LOFF" */
+#define MIDX_CHUNKLOOKUP_WIDTH (sizeof(uint32_t) + sizeof(uint64_t))
+#define MIDX_CHUNK_FANOUT_SIZE (sizeof(uint32_t) * 256)
+#define MIDX_CHUNK_OFFSET_WIDTH (2 * sizeof(uint32_t))
+#define MIDX_CHUNK_LARGE_OFFSET_WIDTH (sizeof(uint64_t))
+#define MIDX_LARGE_OFFSET_NEEDED 0x80000000
+
+struct multi_pack_index *multi_pack_index;
+
+char *get_midx_filename(const char *object_dir)
+{
+	return xstrfmt("%s/pack/multi-pack-index", object_dir);
+}
+
+struct multi_pack_index *load_multi_pack_index(const char *object_dir, int local)
+{
+	struct multi_pack_index *m = NULL;
+	int fd;
+	struct stat st;
+	size_t midx_size;
+	void *midx_map = NULL;
+	uint32_t hash_version;
+	char *midx_name = get_midx_filename(object_dir);
+	uint32_t i;
+	const char *cur_pack_name;
+
+	fd = git_open(midx_name);
+
+	if (fd < 0)
+		goto cleanup_fail;
+	if (fstat(fd, &st)) {
+		error_errno(_("failed to read %s"), midx_name);
+		goto cleanup_fail;
+	}
+
+	midx_size = xsize_t(st.st_size);
+
+	if (midx_size < MIDX_MIN_SIZE) {
+		error(_("multi-pack-index file %s is too small"), midx_name);
+		goto cleanup_fail;
+	}
+
+	FREE_AND_NULL(midx_name);
+
+	midx_map = xmmap(NULL, midx_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	fd = -1;
+
+	FLEX_ALLOC_MEM(m, object_dir, object_dir, strlen(object_dir));
+	m->data = midx_map;
+	m->data_len = midx_size;
+	m->local = local;
+
+	m->signature = get_be32(m->data);
+	if (m->signature != MIDX_SIGNATURE) {
+		error(_("multi-pack-index signature 0x%08x does not match signature 0x%08x"),
+		      m->signature, MIDX_SIGNATURE);
+		goto cleanup_fail;
+	}
+
+	m->version = m->data[MIDX_BYTE_FILE_VERSION];
+	if (m->version != MIDX_VERSION) {
+		error(_("multi-pack-index version %d not recognized"),
+		      m->version);
+		goto cleanup_fail;
+	}
+
+	hash_version = m->data[MIDX_BYTE_HASH_VERSION];
+	if (hash_version != MIDX_HASH_VERSION) {
+		error(_("hash version %u does not match"), hash_version);
+		goto cleanup_fail;
+	}
+	m->hash_len = MIDX_HASH_LEN;
+
+	m->num_chunks = m->data[MIDX_BYTE_NUM_CHUNKS];
+
+	m->num_packs = get_be32(m->data + MIDX_BYTE_NUM_PACKS);
+
+	if (midx_size < MIDX_MIN_SIZE + (m->num_chunks + 1) * MIDX_CHUNKLOOKUP_WIDTH) {
+		error(_("multi-pack-index chunk lookup table is truncated"));
+		goto cleanup_fail;
+	}
+
+	for (i = 0; i < m->num_chunks; i++) {
+		const unsigned char *entry = m->data + MIDX_HEADER_SIZE +
+					     MIDX_CHUNKLOOKUP_WIDTH * i;
+		uint32_t chunk_id = get_be32(entry);
+		uint64_t chunk_offset = get_be64(entry + 4);
+
+		if (chunk_offset > m->data_len - MIDX_HASH_LEN) {
+			error(_("improper chunk offset(s) %"PRIx64), chunk_offset);
+			goto cleanup_fail;
+		}
+
+		switch (chunk_id) {
+		case MIDX_CHUNKID_PACKNAMES:
+			m->chunk_pack_names = m->data + chunk_offset;
+			break;
+
+		case MIDX_CHUNKID_OIDFANOUT:
+			m->chunk_oid_fanout = (uint32_t *)(m->data + chunk_offset);
+			break;
+
+		case MIDX_CHUNKID_OIDLOOKUP:
+			m->chunk_oid_lookup = m->data + chunk_offset;
+			break;
+
+		case MIDX_CHUNKID_OBJECTOFFSETS:
+			m->chunk_object_offsets = m->data + chunk_offset;
+			break;
+
+		case MIDX_CHUNKID_LARGEOFFSETS:
+			m->chunk_large_offsets = m->data + chunk_offset;
+			break;
+
+		case 0:
+			error(_("terminating multi-pack-index chunk id appears earlier than expected"));
+			goto cleanup_fail;
+
+		default:
+			/*
+			 * Do nothing on unrecognized chunks, allowing future
+			 * extensions to add optional chunks.
+			 */
+			break;
+		}
+	}
+
+	if (!m->chunk_pack_names)
+		die(_("multi-pack-index missing required pack-name chunk"));
+	if (!m->chunk_oid_fanout)
+		die(_("multi-pack-index missing required OID fanout chunk"));
+	if (!m->chunk_oid_lookup)
+		die(_("multi-pack-index missing required OID lookup chunk"));
+	if (!m->chunk_object_offsets)
+		die(_("multi-pack-index missing required object offsets chunk"));
+
+	m->num_objects = ntohl(m->chunk_oid_fanout[255]);
+	if (m->chunk_object_offsets + (size_t)m->num_objects * MIDX_CHUNK_OFFSET_WIDTH >
+	    m->data + m->data_len - MIDX_HASH_LEN ||
+	    m->chunk_oid_lookup + (size_t)m->num_objects * m->hash_len >
+	    m->data + m->data_len - MIDX_HASH_LEN)
+		die(_("multi-pack-index object chunks are truncated"));
+
+	m->pack_names = xcalloc(m->num_packs, sizeof(*m->pack_names));
+	m->packs = xcalloc(m->num_packs, sizeof(*m->packs));
+
+	cur_pack_name = (const char *)m->chunk_pack_names;
+	for (i = 0; i < m->num_packs; i++) {
+		const char *end = memchr(cur_pack_name, '\0',
+					 (const char *)m->data + m->data_len -
+					 cur_pack_name);
+		if (!end)
+			die(_("multi-pack-index pack names are truncated"));
+
+		m->pack_names[i] = cur_pack_name;
+		cur_pack_name = end + 1;
+
+		if (i && strcmp(m->pack_names[i], m->pack_names[i - 1]) <= 0)
+			die(_("multi-pack-index pack names out of order: '%s' before '%s'"),
+			    m->pack_names[i - 1],
+			    m->pack_names[i]);
+	}
+
+	return m;
+
+cleanup_fail:
+	free(m);
+	free(midx_name);
+	if (midx_map)
+		munmap(midx_map, midx_size);
+	if (0 <= fd)
+		close(fd);
+	return NULL;
+}
+
+void close_midx(struct multi_pack_index *m)
+{
+	uint32_t i;
+
+	if (!m)
+		return;
+
+	munmap((unsigned char *)m->data, m->data_len);
+
+	for (i = 0; i < m->num_packs; i++) {
+		if (m->packs[i])
+			m->packs[i]->multi_pack_index = 0;
+	}
+	FREE_AND_NULL(m->packs);
+	FREE_AND_NULL(m->pack_names);
+	free(m);
+}
+
+int bsearch_midx(const struct object_id *oid, struct multi_pack_index *m, uint32_t *result)
+{
+	return bsearch_hash(oid->hash, m->chunk_oid_fanout, m->chunk_oid_lookup,
+			    m->hash_len, result);
+}
+
+struct object_id *nth_midxed_object_oid(struct object_id *oid,
+					struct multi_pack_index *m,
+					uint32_t n)
+{
+	if (n >= m->num_objects)
+		return NULL;
+
+	hashcpy(oid->hash, m->chunk_oid_lookup + m->hash_len * n);
+	return oid;
+}
+
+static off_t nth_midxed_offset(struct multi_pack_index *m, uint32_t pos)
+{
+	const unsigned char *offset_data;
+	uint32_t offset32;
+
+	offset_data = m->chunk_object_offsets + pos * MIDX_CHUNK_OFFSET_WIDTH;
+	offset32 = get_be32(offset_data + sizeof(uint32_t));
+
+	if (m->chunk_large_offsets && offset32 & MIDX_LARGE_OFFSET_NEEDED) {
+		if (sizeof(off_t) < sizeof(uint64_t))
+			die(_("multi-pack-index stores a 64-bit offset, but off_t is too small"));
+
+		offset32 ^= MIDX_LARGE_OFFSET_NEEDED;
+		return get_be64(m->chunk_large_offsets + sizeof(uint64_t) * offset32);
+	}
+
+	return offset32;
+}
+
+static uint32_t nth_midxed_pack_int_id(struct multi_pack_index *m, uint32_t pos)
+{
+	return get_be32(m->chunk_object_offsets + pos * MIDX_CHUNK_OFFSET_WIDTH);
+}
+
+int fill_midx_entry(const unsigned char *sha1, struct pack_entry *e,
+		    struct multi_pack_index *m)
+{
+	struct object_id oid;
+	uint32_t pos, pack_int_id;
+	struct packed_git *p;
+
+	hashcpy(oid.hash, sha1);
+	if (!bsearch_midx(&oid, m, &pos))
+		return 0;
+
+	pack_int_id = nth_midxed_pack_int_id(m, pos);
+	if (pack_int_id >= m->num_packs)
+		die(_("bad pack-int-id: %u (%u total packs)"),
+		    pack_int_id, m->num_packs);
+
+	p = m->packs[pack_int_id];
+	if (!p)
+		return 0;
+
+	if (p->num_bad_objects) {
+		uint32_t i;
+		for (i = 0; i < p->num_bad_objects; i++)
+			if (!hashcmp(sha1, p->bad_object_sha1 + 20 * i))
+				return 0;
+	}
+
+	/*
+	 * We are about to tell the caller where they can locate the
+	 * requested object.  We better make sure the packfile is
+	 * still here and can be accessed before supplying that
+	 * answer, as it may have been deleted since the index was
+	 * loaded!
+	 */
+	if (!is_pack_valid(p))
+		return 0;
+
+	e->offset = nth_midxed_offset(m, pos);
+	e->p = p;
+	hashcpy(e->sha1, sha1);
+	return 1;
+}
+
+static int midx_pack_pos(struct multi_pack_index *m, const char *idx_name)
+{
+	uint32_t first = 0, last = m->num_packs;
+
+	while (first < last) {
+		uint32_t mid = first + (last - first) / 2;
+		int cmp = strcmp(idx_name, m->pack_names[mid]);
+
+		if (!cmp)
+			return mid;
+		if (cmp > 0)
+			first = mid + 1;
+		else
+			last = mid;
+	}
+
+	return -1;
+}
+
+int midx_contains_pack(struct multi_pack_index *m, const char *idx_name)
+{
+	return midx_pack_pos(m, idx_name) >= 0;
+}
+
+int prepare_multi_pack_index_one(const char *object_dir, int local)
+{
+	struct multi_pack_index *m;
+
+	if (!core_multi_pack_index)
+		return 0;
+
+	for (m = multi_pack_index; m; m = m->next) {
+		if (!strcmp(object_dir, m->object_dir))
+			return 1;
+	}
+
+	m = load_multi_pack_index(object_dir, local);
+	if (!m)
+		return 0;
+
+	m->next = multi_pack_index;
+	multi_pack_index = m;
+	return 1;
+}
+
+void attach_midx_packs(void)
+{
+	struct multi_pack_index *m;
+	struct strbuf idx_name = STRBUF_INIT;
+
+	for (m = multi_pack_index; m; m = m->next) {
+		struct packed_git *p;
+		size_t dirlen = strlen(m->object_dir);
+
+		for (p = packed_git; p; p = p->next) {
+			const char *base;
+			size_t len;
+			int pos;
+
+			if (p->multi_pack_index ||
+			    strncmp(p->pack_name, m->object_dir, dirlen) ||
+			    !skip_prefix(p->pack_name + dirlen, "/pack/", &base) ||
+			    !strip_suffix(base, ".pack", &len))
+				continue;
+
+			strbuf_reset(&idx_name);
+			strbuf_add(&idx_name, base, len);
+			strbuf_addstr(&idx_name, ".idx");
+
+			pos = midx_pack_pos(m, idx_name.buf);
+			if (pos < 0)
+				continue;
+
+			m->packs[pos] = p;
+			p->multi_pack_index = 1;
+		}
+	}
+
+	strbuf_release(&idx_name);
+}
+
+struct pack_info {
+	uint32_t orig_pack_int_id;
+	char *pack_name;
+	struct packed_git *p;
+	time_t mtime;
+	unsigned from_midx:1;
+};
+
+static int pack_info_compare(const void *_a, const void *_b)
+{
+	struct pack_info *a = (struct pack_info *)_a;
+	struct pack_info *b = (struct pack_info *)_b;
+	return strcmp(a->pack_name, b->pack_name);
+}
+
+struct pack_list {
+	struct pack_info *info;
+	uint32_t nr;
+	uint32_t alloc;
+	struct multi_pack_index *m;
+};
+
+static void add_pack_to_midx(const char *full_path, size_t full_path_len,
+			     const char *file_name, struct pack_list *packs)
+{
+	struct packed_git *p;
+	int pos;
+
+	if (!ends_with(file_name, ".idx"))
+		return;
+
+	ALLOC_GROW(packs->info, packs->nr + 1, packs->alloc);
+
+	if (packs->m && (pos = midx_pack_pos(packs->m, file_name)) >= 0) {
+		struct stat st;
+		struct strbuf pack_path = STRBUF_INIT;
+		size_t len = full_path_len;
+
+		/*
+		 * The objects of this pack can be read from the existing
+		 * multi-pack-index; only check that the pack itself is
+		 * still around.
+		 */
+		strip_suffix_mem(full_path, &len, ".idx");
+		strbuf_add(&pack_path, full_path, len);
+		strbuf_addstr(&pack_path, ".pack");
+		if (stat(pack_path.buf, &st) || !S_ISREG(st.st_mode)) {
+			strbuf_release(&pack_path);
+			return;
+		}
+		strbuf_release(&pack_path);
+
+		packs->info[packs->nr].p = NULL;
+		packs->info[packs->nr].orig_pack_int_id = pos;
+		packs->info[packs->nr].pack_name = xstrdup(file_name);
+		packs->info[packs->nr].mtime = st.st_mtime;
+		packs->info[packs->nr].from_midx = 1;
+		packs->nr++;
+		return;
+	}
+
+	p = add_packed_git(full_path, full_path_len, 0);
+	if (!p) {
+		warning(_("failed to add packfile '%s'"), full_path);
+		return;
+	}
+
+	if (open_pack_index(p)) {
+		warning(_("failed to open pack-index '%s'"), full_path);
+		close_pack(p);
+		free(p);
+		return;
+	}
+
+	packs->info[packs->nr].p = p;
+	packs->info[packs->nr].orig_pack_int_id = packs->nr;
+	packs->info[packs->nr].pack_name = xstrdup(file_name);
+	packs->info[packs->nr].mtime = p->mtime;
+	packs->info[packs->nr].from_midx = 0;
+	packs->nr++;
+}
+
+static void reopen_midx_packs(const char *object_dir, struct pack_list *packs)
+{
+	struct strbuf path = STRBUF_INIT;
+	uint32_t i, nr = 0;
+
+	for (i = 0; i < packs->nr; i++) {
+		struct pack_info *info = &packs->info[i];
+		struct packed_git *p;
+
+		if (info->from_midx) {
+			strbuf_reset(&path);
+			strbuf_addf(&path, "%s/pack/%s", object_dir, info->pack_name);
+			p = add_packed_git(path.buf, path.len, 0);
+			if (!p || open_pack_index(p)) {
+				warning(_("failed to open pack-index '%s'"), path.buf);
+				if (p) {
+					close_pack(p);
+					free(p);
+				}
+				free(info->pack_name);
+				continue;
+			}
+			info->p = p;
+			info->mtime = p->mtime;
+			info->from_midx = 0;
+		}
+		packs->info[nr++] = *info;
+	}
+	packs->nr = nr;
+	strbuf_release(&path);
+}
+
+struct pack_midx_entry {
+	struct object_id oid;
+	uint32_t pack_int_id;
+	time_t pack_mtime;
+	uint64_t offset;
+};
+
+static int midx_oid_compare(const void *_a, const void *_b)
+{
+	const struct pack_midx_entry *a = (const struct pack_midx_entry *)_a;
+	const struct pack_midx_entry *b = (const struct pack_midx_entry *)_b;
+	int cmp = oidcmp(&a->oid, &b->oid);
+
+	if (cmp)
+		return cmp;
+
+	/* Prefer the copy of a duplicate object in the newest pack. */
+	if (a->pack_mtime > b->pack_mtime)
+		return -1;
+	else if (a->pack_mtime < b->pack_mtime)
+		return 1;
+
+	return a->pack_int_id - b->pack_int_id;
+}
+
+static uint32_t get_pack_fanout(struct packed_git *p, uint32_t value)
+{
+	const uint32_t *level1_ofs = p->index_data;
+
+	if (p->index_version > 1)
+		level1_ofs += 2;
+
+	return ntohl(level1_ofs[value]);
+}
+
+/*
+ * Collect the entries of all packs, one fanout bucket at a time so that
+ * the sorting scratch space stays proportional to a single bucket, and
+ * keep only one copy of each object.
+ *
+ * The entries of packs that were covered by the previous
+ * multi-pack-index "m" are read from it; "perm" maps their pack-int-id
+ * in "m" to the new one, or to -1 for packs that disappeared.
+ */
+static struct pack_midx_entry *get_sorted_entries(struct multi_pack_index *m,
+						  const int32_t *perm,
+						  struct pack_info *info,
+						  uint32_t nr_packs,
+						  uint32_t *nr_objects)
+{
+	uint32_t cur_fanout, cur_pack, cur_object;
+	uint32_t alloc_fanout, alloc_objects, total_objects = 0;
+	struct pack_midx_entry *entries_by_fanout = NULL;
+	struct pack_midx_entry *deduplicated_entries = NULL;
+
+	for (cur_pack = 0; cur_pack < nr_packs; cur_pack++) {
+		if (info[cur_pack].p)
+			total_objects += info[cur_pack].p->num_objects;
+	}
+	if (m)
+		total_objects += m->num_objects;
+
+	/*
+	 * As we de-duplicate by fanout value, we expect the fanout
+	 * slices to be evenly distributed, with some noise. Hence,
+	 * allocate slightly more than one 256th.
+	 */
+	alloc_objects = alloc_fanout = total_objects > 3200 ? total_objects / 200 : 16;
+
+	ALLOC_ARRAY(entries_by_fanout, alloc_fanout);
+	ALLOC_ARRAY(deduplicated_entries, alloc_objects);
+	*nr_objects = 0;
+
+	for (cur_fanout = 0; cur_fanout < 256; cur_fanout++) {
+		uint32_t nr_fanout = 0;
+
+		if (m) {
+			uint32_t start = 0, end;
+
+			if (cur_fanout)
+				start = ntohl(m->chunk_oid_fanout[cur_fanout - 1]);
+			end = ntohl(m->chunk_oid_fanout[cur_fanout]);
+
+			for (cur_object = start; cur_object < end; cur_object++) {
+				uint32_t orig = nth_midxed_pack_int_id(m, cur_object);
+				struct pack_midx_entry *entry;
+
+				if (orig >= m->num_packs || perm[orig] < 0)
+					continue;
+
+				ALLOC_GROW(entries_by_fanout, nr_fanout + 1, alloc_fanout);
+				entry = &entries_by_fanout[nr_fanout++];
+				nth_midxed_object_oid(&entry->oid, m, cur_object);
+				entry->pack_int_id = perm[orig];
+				entry->pack_mtime = info[perm[orig]].mtime;
+				entry->offset = nth_midxed_offset(m, cur_object);
+			}
+		}
+
+		for (cur_pack = 0; cur_pack < nr_packs; cur_pack++) {
+			struct packed_git *p = info[cur_pack].p;
+			uint32_t start = 0, end;
+
+			if (!p)
+				continue;
+
+			if (cur_fanout)
+				start = get_pack_fanout(p, cur_fanout - 1);
+			end = get_pack_fanout(p, cur_fanout);
+
+			for (cur_object = start; cur_object < end; cur_object++) {
+				struct pack_midx_entry *entry;
+
+				ALLOC_GROW(entries_by_fanout, nr_fanout + 1, alloc_fanout);
+				entry = &entries_by_fanout[nr_fanout++];
+				if (!nth_packed_object_oid(&entry->oid, p, cur_object))
+					die(_("failed to locate object %d in packfile"),
+					    cur_object);
+				entry->pack_int_id = cur_pack;
+				entry->pack_mtime = p->mtime;
+				entry->offset = nth_packed_object_offset(p, cur_object);
+			}
+		}
+
+		QSORT(entries_by_fanout, nr_fanout, midx_oid_compare);
+
+		/*
+		 * The batch is now sorted by OID and then mtime (descending).
+		 * Take only the first duplicate.
+		 */
+		for (cur_object = 0; cur_object < nr_fanout; cur_object++) {
+			if (cur_object && !oidcmp(&entries_by_fanout[cur_object - 1].oid,
+						  &entries_by_fanout[cur_object].oid))
+				continue;
+
+			ALLOC_GROW(deduplicated_entries, *nr_objects + 1, alloc_objects);
+			memcpy(&deduplicated_entries[*nr_objects],
+			       &entries_by_fanout[cur_object],
+			       sizeof(struct pack_midx_entry));
+			(*nr_objects)++;
+		}
+	}
+
+	free(entries_by_fanout);
+	return deduplicated_entries;
+}
+
+static size_t write_midx_pack_names(struct hashfile *f,
+				    struct pack_info *info,
+				    uint32_t num_packs)
+{
+	unsigned char padding[MIDX_CHUNK_ALIGNMENT];
+	uint32_t i;
+	size_t written = 0;
+
+	for (i = 0; i < num_packs; i++) {
+		size_t writelen = strlen(info[i].pack_name) + 1;
+
+		if (i && strcmp(info[i].pack_name, info[i - 1].pack_name) <= 0)
+			BUG("incorrect pack-file order: %s before %s",
+			    info[i - 1].pack_name,
+			    info[i].pack_name);
+
+		hashwrite(f, info[i].pack_name, writelen);
+		written += writelen;
+	}
+
+	/* add padding to be aligned */
+	i = MIDX_CHUNK_ALIGNMENT - (written % MIDX_CHUNK_ALIGNMENT);
+	if (i < MIDX_CHUNK_ALIGNMENT) {
+		memset(padding, 0, sizeof(padding));
+		hashwrite(f, padding, i);
+		written += i;
+	}
+
+	return written;
+}
+
+static size_t write_midx_oid_fanout(struct hashfile *f,
+				    struct pack_midx_entry *objects,
+				    uint32_t nr_objects)
+{
+	struct pack_midx_entry *list = objects;
+	struct pack_midx_entry *last = objects + nr_objects;
+	uint32_t count = 0;
+	uint32_t i;
+
+	/*
+	 * Write the first-level table (the list is sorted,
+	 * but we use a 256-entry lookup to be able to avoid
+	 * having to do eight extra binary search iterations).
+	 */
+	for (i = 0; i < 256; i++) {
+		struct pack_midx_entry *next = list;
+
+		while (next < last && next->oid.hash[0] == i) {
+			count++;
+			next++;
+		}
+
+		hashwrite_be32(f, count);
+		list = next;
+	}
+
+	return MIDX_CHUNK_FANOUT_SIZE;
+}
+
+static size_t write_midx_oid_lookup(struct hashfile *f, unsigned char hash_len,
+				    struct pack_midx_entry *objects,
+				    uint32_t nr_objects)
+{
+	struct pack_midx_entry *list = objects;
+	uint32_t i;
+	size_t written = 0;
+
+	for (i = 0; i < nr_objects; i++) {
+		struct pack_midx_entry *obj = list++;
+
+		if (i < nr_objects - 1) {
+			struct pack_midx_entry *next = list;
+			if (oidcmp(&obj->oid, &next->oid) >= 0)
+				BUG("OIDs not in order: %s >= %s",
+				    oid_to_hex(&obj->oid),
+				    oid_to_hex(&next->oid));
+		}
+
+		hashwrite(f, obj->oid.hash, (int)hash_len);
+		written += hash_len;
+	}
+
+	return written;
+}
+
+static size_t write_midx_object_offsets(struct hashfile *f, int large_offset_needed,
+					struct pack_midx_entry *objects, uint32_t nr_objects)
+{
+	struct pack_midx_entry *list = objects;
+	uint32_t i, nr_large_offset = 0;
+	size_t written = 0;
+
+	for (i = 0; i < nr_objects; i++) {
+		struct pack_midx_entry *obj = list++;
+
+		hashwrite_be32(f, obj->pack_int_id);
+
+		if (large_offset_needed && obj->offset >> 31)
+			hashwrite_be32(f, MIDX_LARGE_OFFSET_NEEDED | nr_large_offset++);
+		else if (!large_offset_needed && obj->offset >> 32)
+			BUG("object %s requires a large offset (%"PRIx64") but the MIDX is not writing large offsets!",
+			    oid_to_hex(&obj->oid),
+			    obj->offset);
+		else
+			hashwrite_be32(f, (uint32_t)obj->offset);
+
+		written += MIDX_CHUNK_OFFSET_WIDTH;
+	}
+
+	return written;
+}
+
+static size_t write_midx_large_offsets(struct hashfile *f, uint32_t nr_large_offset,
+				       struct pack_midx_entry *objects, uint32_t nr_objects)
+{
+	struct pack_midx_entry *list = objects;
+	size_t written = 0;
+
+	while (nr_large_offset) {
+		struct pack_midx_entry *obj = list++;
+		uint64_t offset = obj->offset;
+
+		if (!(offset >> 31))
+			continue;
+
+		hashwrite_be32(f, offset >> 32);
+		hashwrite_be32(f, offset & 0xffffffffUL);
+		written += 2 * sizeof(uint32_t);
+
+		nr_large_offset--;
+	}
+
+	return written;
+}
+
+int write_midx_file(const char *object_dir)
+{
+	unsigned char cur_chunk, num_chunks = 0;
+	char *midx_name;
+	uint32_t i;
+	struct hashfile *f = NULL;
+	struct lock_file lk = LOCK_INIT;
+	struct pack_list packs;
+	int32_t *pack_perm = NULL;
+	uint64_t written = 0;
+	uint32_t chunk_ids[MIDX_MAX_CHUNKS + 1];
+	uint64_t chunk_offsets[MIDX_MAX_CHUNKS + 1];
+	uint32_t nr_entries, num_large_offsets = 0;
+	struct pack_midx_entry *entries = NULL;
+	int large_offsets_needed = 0;
+	struct strbuf pack_dir = STRBUF_INIT;
+	DIR *dir;
+
+	midx_name = get_midx_filename(object_dir);
+	if (safe_create_leading_directories(midx_name)) {
+		UNLEAK(midx_name);
+		die_errno(_("unable to create leading directories of %s"),
+			  midx_name);
+	}
+
+	packs.m = load_multi_pack_index(object_dir, 1);
+	packs.nr = 0;
+	packs.alloc = packs.m ? packs.m->num_packs : 16;
+	packs.info = NULL;
+	ALLOC_ARRAY(packs.info, packs.alloc);
+
+	strbuf_addf(&pack_dir, "%s/pack", object_dir);
+	dir = opendir(pack_dir.buf);
+	if (dir) {
+		size_t dirnamelen;
+		struct dirent *de;
+
+		strbuf_addch(&pack_dir, '/');
+		dirnamelen = pack_dir.len;
+		while ((de = readdir(dir)) != NULL) {
+			if (is_dot_or_dotdot(de->d_name))
+				continue;
+
+			strbuf_setlen(&pack_dir, dirnamelen);
+			strbuf_addstr(&pack_dir, de->d_name);
+			add_pack_to_midx(pack_dir.buf, pack_dir.len,
+					 de->d_name, &packs);
+		}
+		closedir(dir);
+	} else if (errno != ENOENT) {
+		error_errno(_("unable to open object pack directory: %s"),
+			    pack_dir.buf);
+	}
+	strbuf_release(&pack_dir);
+
+	QSORT(packs.info, packs.nr, pack_info_compare);
+
+	/*
+	 * Map the pack-int-ids of the previous multi-pack-index to the
+	 * sorted positions of the packs that are still present.
+	 */
+	if (packs.m) {
+		ALLOC_ARRAY(pack_perm, packs.m->num_packs);
+		for (i = 0; i < packs.m->num_packs; i++)
+			pack_perm[i] = -1;
+		for (i = 0; i < packs.nr; i++) {
+			if (packs.info[i].from_midx)
+				pack_perm[packs.info[i].orig_pack_int_id] = i;
+		}
+
+		/*
+		 * The previous multi-pack-index kept only one copy of each
+		 * object. If one of its packs went away, copies of its
+		 * objects in the remaining packs are not recorded anywhere,
+		 * so read the .idx of every pack again.
+		 */
+		for (i = 0; i < packs.m->num_packs; i++) {
+			if (pack_perm[i] < 0)
+				break;
+		}
+		if (i < packs.m->num_packs) {
+			FREE_AND_NULL(pack_perm);
+			close_midx(packs.m);
+			packs.m = NULL;
+			reopen_midx_packs(object_dir, &packs);
+		}
+	}
+
+	entries = get_sorted_entries(packs.m, pack_perm, packs.info, packs.nr,
+				     &nr_entries);
+
+	for (i = 0; i < nr_entries; i++) {
+		if (entries[i].offset > 0x7fffffff)
+			num_large_offsets++;
+		if (entries[i].offset > 0xffffffff)
+			large_offsets_needed = 1;
+	}
+
+	hold_lock_file_for_update(&lk, midx_name, LOCK_DIE_ON_ERROR);
+	f = hashfd(get_lock_file_fd(&lk), get_lock_file_path(&lk));
+	FREE_AND_NULL(midx_name);
+
+	cur_chunk = 0;
+	num_chunks = large_offsets_needed ? 5 : 4;
+
+	written = MIDX_HEADER_SIZE;
+	hashwrite_be32(f, MIDX_SIGNATURE);
+	hashwrite_u8(f, MIDX_VERSION);
+	hashwrite_u8(f, MIDX_HASH_VERSION);
+	hashwrite_u8(f, num_chunks);
+	hashwrite_u8(f, 0); /* unused: number of base multi-pack-indexes */
+	hashwrite_be32(f, packs.nr);
+
+	chunk_offsets[cur_chunk] = written + (num_chunks + 1) * MIDX_CHUNKLOOKUP_WIDTH;
+
+	chunk_ids[cur_chunk] = MIDX_CHUNKID_PACKNAMES;
+
+	cur_chunk++;
+	chunk_ids[cur_chunk] = MIDX_CHUNKID_OIDFANOUT;
+	chunk_offsets[cur_chunk] = chunk_offsets[cur_chunk - 1];
+	for (i = 0; i < packs.nr; i++)
+		chunk_offsets[cur_chunk] += strlen(packs.info[i].pack_name) + 1;
+	if (chunk_offsets[cur_chunk] % MIDX_CHUNK_ALIGNMENT)
+		chunk_offsets[cur_chunk] += MIDX_CHUNK_ALIGNMENT -
+			(chunk_offsets[cur_chunk] % MIDX_CHUNK_ALIGNMENT);
+
+	cur_chunk++;
+	chunk_ids[cur_chunk] = MIDX_CHUNKID_OIDLOOKUP;
+	chunk_offsets[cur_chunk] = chunk_offsets[cur_chunk - 1] + MIDX_CHUNK_FANOUT_SIZE;
+
+	cur_chunk++;
+	chunk_ids[cur_chunk] = MIDX_CHUNKID_OBJECTOFFSETS;
+	chunk_offsets[cur_chunk] = chunk_offsets[cur_chunk - 1] + nr_entries * MIDX_HASH_LEN;
+
+	cur_chunk++;
+	chunk_offsets[cur_chunk] = chunk_offsets[cur_chunk - 1] + nr_entries * MIDX_CHUNK_OFFSET_WIDTH;
+	if (large_offsets_needed) {
+		chunk_ids[cur_chunk] = MIDX_CHUNKID_LARGEOFFSETS;
+
+		cur_chunk++;
+		chunk_offsets[cur_chunk] = chunk_offsets[cur_chunk - 1] +
+					   num_large_offsets * MIDX_CHUNK_LARGE_OFFSET_WIDTH;
+	}
+
+	chunk_ids[cur_chunk] = 0;
+
+	for (i = 0; i <= num_chunks; i++) {
+		if (i && chunk_offsets[i] < chunk_offsets[i - 1])
+			BUG("incorrect chunk offsets: %"PRIu64" before %"PRIu64,
+			    chunk_offsets[i - 1],
+			    chunk_offsets[i]);
+
+		if (chunk_offsets[i] % MIDX_CHUNK_ALIGNMENT)
+			BUG("chunk offset %"PRIu64" is not properly aligned",
+			    chunk_offsets[i]);
+
+		hashwrite_be32(f, chunk_ids[i]);
+		hashwrite_be32(f, chunk_offsets[i] >> 32);
+		hashwrite_be32(f, chunk_offsets[i]);
+
+		written += MIDX_CHUNKLOOKUP_WIDTH;
+	}
+
+	for (i = 0; i < num_chunks; i++) {
+		if (written != chunk_offsets[i])
+			BUG("incorrect chunk offset (%"PRIu64" != %"PRIu64") for chunk id %"PRIx32,
+			    chunk_offsets[i],
+			    written,
+			    chunk_ids[i]);
+
+		switch (chunk_ids[i]) {
+		case MIDX_CHUNKID_PACKNAMES:
+			written += write_midx_pack_names(f, packs.info, packs.nr);
+			break;
+
+		case MIDX_CHUNKID_OIDFANOUT:
+			written += write_midx_oid_fanout(f, entries, nr_entries);
+			break;
+
+		case MIDX_CHUNKID_OIDLOOKUP:
+			written += write_midx_oid_lookup(f, MIDX_HASH_LEN, entries, nr_entries);
+			break;
+
+		case MIDX_CHUNKID_OBJECTOFFSETS:
+			written += write_midx_object_offsets(f, large_offsets_needed, entries, nr_entries);
+			break;
+
+		case MIDX_CHUNKID_LARGEOFFSETS:
+			written += write_midx_large_offsets(f, num_large_offsets, entries, nr_entries);
+			break;
+
+		default:
+			BUG("trying to write unknown chunk id %"PRIx32,
+			    chunk_ids[i]);
+		}
+	}
+
+	if (written != chunk_offsets[num_chunks])
+		BUG("incorrect final offset %"PRIu64" != %"PRIu64,
+		    written,
+		    chunk_offsets[num_chunks]);
+
+	hashclose(f, NULL, CSUM_HASH_IN_STREAM);
+	if (commit_lock_file(&lk))
+		die_errno(_("unable to write multi-pack-index file"));
+
+	for (i = 0; i < packs.nr; i++) {
+		if (packs.info[i].p) {
+			close_pack(packs.info[i].p);
+			free(packs.info[i].p);
+		}
+		free(packs.info[i].pack_name);
+	}
+
+	free(packs.info);
+	free(entries);
+	free(pack_perm);
+	close_midx(packs.m);
+	return 0;
+}
+
+void clear_midx_file(const char *object_dir)
+{
+	char *midx = get_midx_filename(object_dir);
+
+	if (remove_path(midx)) {
+		UNLEAK(midx);
+		die(_("failed to clear multi-pack-index at %s"), midx);
+	}
+
+	free(midx);
+}
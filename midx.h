@@ -0,0 +1,78 @@
+#ifndef MIDX_H
+#define MIDX_H
+
+#include "git-compat-util.h"
+
+struct pack_entry;
+struct packed_git;
+
+/*
+ * A multi-pack-index maps every object of a set of packfiles in one
+ * object directory to the pack containing it and the offset within that
+ * pack, so that a single binary search replaces a search of every .idx.
+ */
+struct multi_pack_index {
+	struct multi_pack_index *next;
+
+	const unsigned char *data;
+	size_t data_len;
+
+	uint32_t signature;
+	unsigned char version;
+	unsigned char hash_len;
+	unsigned char num_chunks;
+	uint32_t num_packs;
+	uint32_t num_objects;
+
+	int local;
+
+	const unsigned char *chunk_pack_names;
+	const uint32_t *chunk_oid_fanout;
+	const unsigned char *chunk_oid_lookup;
+	const unsigned char *chunk_object_offsets;
+	const unsigned char *chunk_large_offsets;
+
+	const char **pack_names;
+	struct packed_git **packs;
+	char object_dir[FLEX_ARRAY];
+};
+
+/* The multi-pack-indexes of the object directory and its alternates. */
+extern struct multi_pack_index *multi_pack_index;
+
+char *get_midx_filename(const char *object_dir);
+
+struct multi_pack_index *load_multi_pack_index(const char *object_dir, int local);
+void close_midx(struct multi_pack_index *m);
+
+/*
+ * Load the multi-pack-index of "object_dir" into the multi_pack_index
+ * list if core.multiPackIndex is enabled and it was not loaded yet.
+ * Returns 1 if the object directory has a usable multi-pack-index.
+ */
+int prepare_multi_pack_index_one(const char *object_dir, int local);
+
+/*
+ * Associate every pack in the packed_git list that is covered by a
+ * loaded multi-pack-index with that index, and mark it so that
+ * find_pack_entry() does not search its .idx separately.
+ */
+void attach_midx_packs(void);
+
+int bsearch_midx(const struct object_id *oid, struct multi_pack_index *m, uint32_t *result);
+struct object_id *nth_midxed_object_oid(struct object_id *oid,
+					struct multi_pack_index *m,
+					uint32_t n);
+int fill_midx_entry(const unsigned char *sha1, struct pack_entry *e,
+		    struct multi_pack_index *m);
+int midx_contains_pack(struct multi_pack_index *m, const char *idx_name);
+
+/*
+ * Write a multi-pack-index covering every pack in "object_dir". Objects
+ * of packs that are already covered by an existing multi-pack-index are
+ * taken from it instead of re-reading those packs' .idx files.
+ */
+int write_midx_file(const char *object_dir);
+void clear_midx_file(const char *object_dir);
+
+#endif
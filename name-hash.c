@@ -7,6 +7,7 @@
  */
 #define NO_THE_INDEX_COMPATIBILITY_MACROS
 #include "cache.h"
+#include "sparse-index.h"
 
 struct dir_entry {
 	struct hashmap_entry ent;
@@ -722,6 +723,19 @@ struct cache_entry *index_file_exists(struct index_state *istate, const char *na
 			return ce;
 		ce = hashmap_get_next(&istate->name_hash, ce);
 	}
+
+	/*
+	 * The path may be hidden in a sparse directory; looking it up
+	 * by position expands the index if that is the case.
+	 */
+	if (istate->sparse_index) {
+		if (icase)
+			ensure_full_index(istate);
+		else
+			index_name_pos(istate, name, namelen);
+		if (!istate->sparse_index)
+			return index_file_exists(istate, name, namelen, icase);
+	}
 	return NULL;
 }
 
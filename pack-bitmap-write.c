@@ -36,6 +36,10 @@ struct bitmap_writer {
 	struct progress *progress;
 	int show_progress;
 	unsigned char pack_checksum[20];
+
+	/* Writing a bitmap layer on top of the pack with this checksum */
+	int is_layer;
+	unsigned char layer_base[20];
 };
 
 static struct bitmap_writer writer;
@@ -48,7 +52,8 @@ void bitmap_writer_show_progress(int show)
 /**
  * Build the initial type index for the packfile
  */
-void bitmap_writer_build_type_index(struct pack_idx_entry **index,
+void bitmap_writer_build_type_index(struct packing_data *to_pack,
+				    struct pack_idx_entry **index,
 				    uint32_t index_nr)
 {
 	uint32_t i;
@@ -57,19 +62,20 @@ void bitmap_writer_build_type_index(struct pack_idx_entry **index,
 	writer.trees = ewah_new();
 	writer.blobs = ewah_new();
 	writer.tags = ewah_new();
+	ALLOC_ARRAY(to_pack->in_pack_pos, to_pack->nr_objects);
 
 	for (i = 0; i < index_nr; ++i) {
 		struct object_entry *entry = (struct object_entry *)index[i];
 		enum object_type real_type;
 
-		entry->in_pack_pos = i;
+		oe_set_in_pack_pos(to_pack, entry, i);
 
-		switch (entry->type) {
+		switch (oe_type(entry)) {
 		case OBJ_COMMIT:
 		case OBJ_TREE:
 		case OBJ_BLOB:
 		case OBJ_TAG:
-			real_type = entry->type;
+			real_type = oe_type(entry);
 			break;
 
 		default:
@@ -98,7 +104,7 @@ void bitmap_writer_build_type_index(struct pack_idx_entry **index,
 		default:
 			die("Missing type information for %s (%d/%d)",
 			    oid_to_hex(&entry->idx.oid), real_type,
-			    entry->type);
+			    oe_type(entry));
 		}
 	}
 }
@@ -147,7 +153,7 @@ static uint32_t find_object_pos(const unsigned char *sha1)
 			"(object %s is missing)", sha1_to_hex(sha1));
 	}
 
-	return entry->in_pack_pos;
+	return oe_in_pack_pos(writer.to_pack, entry);
 }
 
 static void show_object(struct object *object, const char *name, void *data)
@@ -322,6 +328,51 @@ void bitmap_writer_build(struct packing_data *to_pack)
 	compute_xor_offsets();
 }
 
+/**
+ * Compute the bitmaps of a layer on top of the existing bitmap index: the
+ * existing bitmaps cover everything below the new pack, so we only walk
+ * the new commits. Ancestors come first so that the walk for each commit
+ * can stop at the bitmaps computed for earlier ones.
+ */
+void bitmap_writer_build_layer(struct packing_data *to_pack)
+{
+	static const double REUSE_BITMAP_THRESHOLD = 0.2;
+
+	int i, reuse_after;
+
+	writer.bitmaps = kh_init_sha1();
+	writer.to_pack = to_pack;
+
+	if (writer.show_progress)
+		writer.progress = start_progress("Building bitmap layer", writer.selected_nr);
+
+	reuse_after = writer.selected_nr * REUSE_BITMAP_THRESHOLD;
+
+	for (i = writer.selected_nr - 1; i >= 0; --i) {
+		struct bitmapped_commit *stored = &writer.selected[i];
+		struct object *object = (struct object *)stored->commit;
+		khiter_t hash_pos;
+		int hash_ret;
+
+		stored->bitmap = bitmap_for_layer_commit(stored->commit, to_pack);
+
+		if (i >= reuse_after)
+			stored->flags |= BITMAP_FLAG_REUSE;
+
+		hash_pos = kh_put_sha1(writer.bitmaps, object->oid.hash, &hash_ret);
+		if (hash_ret == 0)
+			die("Duplicate entry when writing index: %s",
+			    oid_to_hex(&object->oid));
+
+		kh_value(writer.bitmaps, hash_pos) = stored;
+		display_progress(writer.progress, writer.selected_nr - i);
+	}
+
+	stop_progress(&writer.progress);
+
+	compute_xor_offsets();
+}
+
 /**
  * Select the commits that will be bitmapped
  */
@@ -503,6 +554,12 @@ void bitmap_writer_set_checksum(unsigned char *sha1)
 	hashcpy(writer.pack_checksum, sha1);
 }
 
+void bitmap_writer_set_layer_base(const unsigned char *sha1)
+{
+	writer.is_layer = 1;
+	hashcpy(writer.layer_base, sha1);
+}
+
 void bitmap_writer_finish(struct pack_idx_entry **index,
 			  uint32_t index_nr,
 			  const char *filename,
@@ -519,13 +576,18 @@ void bitmap_writer_finish(struct pack_idx_entry **index,
 
 	f = hashfd(fd, tmp_file.buf);
 
-	memcpy(header.magic, BITMAP_IDX_SIGNATURE, sizeof(BITMAP_IDX_SIGNATURE));
+	if (writer.is_layer)
+		memcpy(header.magic, BITMAP_LAYER_SIGNATURE, sizeof(BITMAP_LAYER_SIGNATURE));
+	else
+		memcpy(header.magic, BITMAP_IDX_SIGNATURE, sizeof(BITMAP_IDX_SIGNATURE));
 	header.version = htons(default_version);
 	header.options = htons(flags | options);
 	header.entry_count = htonl(writer.selected_nr);
 	hashcpy(header.checksum, writer.pack_checksum);
 
 	hashwrite(f, &header, sizeof(header));
+	if (writer.is_layer)
+		hashwrite(f, writer.layer_base, sizeof(writer.layer_base));
 	dump_bitmap(f, writer.commits);
 	dump_bitmap(f, writer.trees);
 	dump_bitmap(f, writer.blobs);
@@ -29,18 +29,15 @@ struct stored_bitmap {
  *
  * If there is more than one bitmap index available (e.g. because of alternates),
  * the active bitmap index is the largest one.
+ *
+ * Incremental bitmap layers may be stacked on top of the active index; each
+ * of them is a `struct bitmap_index` of its own, whose objects take the bit
+ * positions following those of the index and the layers below it.
  */
 static struct bitmap_index {
 	/* Packfile to which this bitmap index belongs to */
 	struct packed_git *pack;
 
-	/*
-	 * Mark the first `reuse_objects` in the packfile as reused:
-	 * they will be sent as-is without using them for repacking
-	 * calculations
-	 */
-	uint32_t reuse_objects;
-
 	/* mmapped buffer of the whole bitmap index */
 	unsigned char *map;
 	size_t map_size; /* size of the mmaped buffer */
@@ -87,7 +84,26 @@ static struct bitmap_index {
 	/* Version of the bitmap index */
 	unsigned int version;
 
+	/* Checksum of `pack`, as recorded in the bitmap header */
+	unsigned char checksum[20];
+
+	/* For a layer: checksum of the pack directly below it */
+	unsigned char base_checksum[20];
+
+	/* For a layer: bit position of the first object in `pack` */
+	uint32_t offset;
+
+	/*
+	 * For the active index: the layers stacked on top of it, bottom
+	 * first, and the number of bit positions taken by its own objects
+	 * and the objects of all of its layers.
+	 */
+	struct bitmap_index **layers;
+	unsigned int layers_nr, layers_alloc;
+	uint32_t num_objects;
+
 	unsigned loaded : 1;
+	unsigned is_layer : 1;
 
 } bitmap_git;
 
@@ -139,9 +155,16 @@ static int load_bitmap_header(struct bitmap_index *index)
 	if (index->map_size < sizeof(*header) + 20)
 		return error("Corrupted bitmap index (missing header data)");
 
-	if (memcmp(header->magic, BITMAP_IDX_SIGNATURE, sizeof(BITMAP_IDX_SIGNATURE)) != 0)
+	if (!memcmp(header->magic, BITMAP_IDX_SIGNATURE, sizeof(BITMAP_IDX_SIGNATURE)))
+		index->is_layer = 0;
+	else if (!memcmp(header->magic, BITMAP_LAYER_SIGNATURE, sizeof(BITMAP_LAYER_SIGNATURE)))
+		index->is_layer = 1;
+	else
 		return error("Corrupted bitmap index file (wrong header)");
 
+	if (index->is_layer && index->map_size < sizeof(*header) + 20 + 20)
+		return error("Corrupted bitmap layer (missing header data)");
+
 	index->version = ntohs(header->version);
 	if (index->version != 1)
 		return error("Unsupported version for bitmap index file (%d)", index->version);
@@ -161,7 +184,13 @@ static int load_bitmap_header(struct bitmap_index *index)
 	}
 
 	index->entry_count = ntohl(header->entry_count);
+	hashcpy(index->checksum, header->checksum);
 	index->map_pos += sizeof(*header);
+
+	if (index->is_layer) {
+		hashcpy(index->base_checksum, index->map + index->map_pos);
+		index->map_pos += 20;
+	}
 	return 0;
 }
 
@@ -248,13 +277,13 @@ static int load_bitmap_entries_v1(struct bitmap_index *index)
 	return 0;
 }
 
-static char *pack_bitmap_filename(struct packed_git *p)
+static char *pack_bitmap_filename(struct packed_git *p, const char *ext)
 {
 	size_t len;
 
 	if (!strip_suffix(p->pack_name, ".pack", &len))
 		die("BUG: pack_name does not end in .pack");
-	return xstrfmt("%.*s.bitmap", (int)len, p->pack_name);
+	return xstrfmt("%.*s.%s", (int)len, p->pack_name, ext);
 }
 
 static int open_pack_bitmap_1(struct packed_git *packfile)
@@ -266,7 +295,7 @@ static int open_pack_bitmap_1(struct packed_git *packfile)
 	if (open_pack_index(packfile))
 		return -1;
 
-	idx_name = pack_bitmap_filename(packfile);
+	idx_name = pack_bitmap_filename(packfile, "bitmap");
 	fd = git_open(idx_name);
 	free(idx_name);
 
@@ -290,7 +319,7 @@ static int open_pack_bitmap_1(struct packed_git *packfile)
 	bitmap_git.map_pos = 0;
 	close(fd);
 
-	if (load_bitmap_header(&bitmap_git) < 0) {
+	if (load_bitmap_header(&bitmap_git) < 0 || bitmap_git.is_layer) {
 		munmap(bitmap_git.map, bitmap_git.map_size);
 		bitmap_git.map = NULL;
 		bitmap_git.map_size = 0;
@@ -300,13 +329,120 @@ static int open_pack_bitmap_1(struct packed_git *packfile)
 	return 0;
 }
 
+static struct bitmap_index *open_bitmap_layer(struct packed_git *packfile)
+{
+	struct bitmap_index *layer;
+	int fd;
+	struct stat st;
+	char *layer_name;
+
+	if (packfile == bitmap_git.pack || open_pack_index(packfile))
+		return NULL;
+
+	layer_name = pack_bitmap_filename(packfile, "bitmap-layer");
+	fd = git_open(layer_name);
+	free(layer_name);
+
+	if (fd < 0)
+		return NULL;
+
+	if (fstat(fd, &st)) {
+		close(fd);
+		return NULL;
+	}
+
+	layer = xcalloc(1, sizeof(*layer));
+	layer->pack = packfile;
+	layer->map_size = xsize_t(st.st_size);
+	layer->map = xmmap(NULL, layer->map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (load_bitmap_header(layer) < 0 || !layer->is_layer) {
+		munmap(layer->map, layer->map_size);
+		free(layer);
+		return NULL;
+	}
+
+	return layer;
+}
+
+/*
+ * Stack every layer whose base is the topmost pack so far on top of the
+ * active bitmap index. Layers whose base is gone (e.g. because the base
+ * pack was repacked) are ignored.
+ */
+static void open_bitmap_layers(void)
+{
+	struct bitmap_index **candidates = NULL;
+	size_t i, nr = 0, alloc = 0;
+	const unsigned char *top = bitmap_git.checksum;
+	struct packed_git *p;
+
+	bitmap_git.num_objects = bitmap_git.pack->num_objects;
+
+	for (p = packed_git; p; p = p->next) {
+		struct bitmap_index *layer = open_bitmap_layer(p);
+		if (!layer)
+			continue;
+		ALLOC_GROW(candidates, nr + 1, alloc);
+		candidates[nr++] = layer;
+	}
+
+	for (;;) {
+		struct bitmap_index *layer;
+
+		for (i = 0; i < nr; i++)
+			if (candidates[i] &&
+			    !hashcmp(candidates[i]->base_checksum, top))
+				break;
+		if (i == nr)
+			break;
+
+		layer = candidates[i];
+		candidates[i] = NULL;
+
+		layer->offset = bitmap_git.num_objects;
+		bitmap_git.num_objects += layer->pack->num_objects;
+		ALLOC_GROW(bitmap_git.layers, bitmap_git.layers_nr + 1,
+			   bitmap_git.layers_alloc);
+		bitmap_git.layers[bitmap_git.layers_nr++] = layer;
+		top = layer->checksum;
+	}
+
+	for (i = 0; i < nr; i++) {
+		if (!candidates[i])
+			continue;
+		munmap(candidates[i]->map, candidates[i]->map_size);
+		free(candidates[i]);
+	}
+	free(candidates);
+}
+
+static int load_bitmap_layer(struct bitmap_index *layer)
+{
+	layer->bitmaps = bitmap_git.bitmaps;
+	if (load_pack_revindex(layer->pack))
+		return -1;
+
+	if (!(layer->commits = read_bitmap_1(layer)) ||
+		!(layer->trees = read_bitmap_1(layer)) ||
+		!(layer->blobs = read_bitmap_1(layer)) ||
+		!(layer->tags = read_bitmap_1(layer)))
+		return -1;
+
+	return load_bitmap_entries_v1(layer);
+}
+
 static int load_pack_bitmap(void)
 {
+	unsigned int i;
+
 	assert(bitmap_git.map && !bitmap_git.loaded);
 
 	bitmap_git.bitmaps = kh_init_sha1();
 	bitmap_git.ext_index.positions = kh_init_sha1_pos();
-	load_pack_revindex(bitmap_git.pack);
+	if (load_pack_revindex(bitmap_git.pack))
+		goto failed;
 
 	if (!(bitmap_git.commits = read_bitmap_1(&bitmap_git)) ||
 		!(bitmap_git.trees = read_bitmap_1(&bitmap_git)) ||
@@ -317,6 +453,10 @@ static int load_pack_bitmap(void)
 	if (load_bitmap_entries_v1(&bitmap_git) < 0)
 		goto failed;
 
+	for (i = 0; i < bitmap_git.layers_nr; i++)
+		if (load_bitmap_layer(bitmap_git.layers[i]) < 0)
+			goto failed;
+
 	bitmap_git.loaded = 1;
 	return 0;
 
@@ -340,6 +480,9 @@ static int open_pack_bitmap(void)
 			ret = 0;
 	}
 
+	if (!ret)
+		open_bitmap_layers();
+
 	return ret;
 }
 
@@ -366,7 +509,7 @@ static inline int bitmap_position_extended(const unsigned char *sha1)
 
 	if (pos < kh_end(positions)) {
 		int bitmap_pos = kh_value(positions, pos);
-		return bitmap_pos + bitmap_git.pack->num_objects;
+		return bitmap_pos + bitmap_git.num_objects;
 	}
 
 	return -1;
@@ -375,10 +518,28 @@ static inline int bitmap_position_extended(const unsigned char *sha1)
 static inline int bitmap_position_packfile(const unsigned char *sha1)
 {
 	off_t offset = find_pack_entry_one(sha1, bitmap_git.pack);
-	if (!offset)
-		return -1;
+	unsigned int i;
+	uint32_t pos;
+
+	if (offset) {
+		if (offset_to_pack_pos(bitmap_git.pack, offset, &pos) < 0)
+			return -1;
+		return pos;
+	}
+
+	for (i = 0; i < bitmap_git.layers_nr; i++) {
+		struct bitmap_index *layer = bitmap_git.layers[i];
+
+		offset = find_pack_entry_one(sha1, layer->pack);
+		if (!offset)
+			continue;
+
+		if (offset_to_pack_pos(layer->pack, offset, &pos) < 0)
+			return -1;
+		return layer->offset + pos;
+	}
 
-	return find_revindex_position(bitmap_git.pack, offset);
+	return -1;
 }
 
 static int bitmap_position(const unsigned char *sha1)
@@ -412,7 +573,7 @@ static int ext_index_add_object(struct object *object, const char *name)
 		bitmap_pos = kh_value(eindex->positions, hash_pos);
 	}
 
-	return bitmap_pos + bitmap_git.pack->num_objects;
+	return bitmap_pos + bitmap_git.num_objects;
 }
 
 static void show_object(struct object *object, const char *name, void *data)
@@ -583,7 +744,7 @@ static void show_extended_objects(struct bitmap *objects,
 	for (i = 0; i < eindex->count; ++i) {
 		struct object *obj;
 
-		if (!bitmap_get(objects, bitmap_git.pack->num_objects + i))
+		if (!bitmap_get(objects, bitmap_git.num_objects + i))
 			continue;
 
 		obj = eindex->objects[i];
@@ -603,9 +764,6 @@ static void show_objects_for_type(
 	struct ewah_iterator it;
 	eword_t filter;
 
-	if (bitmap_git.reuse_objects == bitmap_git.pack->num_objects)
-		return;
-
 	ewah_iterator_init(&it, type_filter);
 
 	while (i < objects->word_alloc && ewah_iterator_next(&filter, &it)) {
@@ -613,7 +771,8 @@ static void show_objects_for_type(
 
 		for (offset = 0; offset < BITS_IN_EWORD; ++offset) {
 			struct object_id oid;
-			struct revindex_entry *entry;
+			uint32_t index_pos;
+			off_t ofs;
 			uint32_t hash = 0;
 
 			if ((word >> offset) == 0)
@@ -621,16 +780,14 @@ static void show_objects_for_type(
 
 			offset += ewah_bit_ctz64(word >> offset);
 
-			if (pos + offset < bitmap_git.reuse_objects)
-				continue;
-
-			entry = &bitmap_git.pack->revindex[pos + offset];
-			nth_packed_object_oid(&oid, bitmap_git.pack, entry->nr);
+			index_pos = pack_pos_to_index(bitmap_git.pack, pos + offset);
+			ofs = pack_pos_to_offset(bitmap_git.pack, pos + offset);
+			nth_packed_object_oid(&oid, bitmap_git.pack, index_pos);
 
 			if (bitmap_git.hashes)
-				hash = get_be32(bitmap_git.hashes + entry->nr);
+				hash = get_be32(bitmap_git.hashes + index_pos);
 
-			show_reach(&oid, object_type, 0, hash, bitmap_git.pack, entry->offset);
+			show_reach(&oid, object_type, 0, hash, bitmap_git.pack, ofs);
 		}
 
 		pos += BITS_IN_EWORD;
@@ -638,14 +795,69 @@ static void show_objects_for_type(
 	}
 }
 
+/*
+ * Show the objects of the bitmap layer `layer` with the given type that
+ * are set in `objects`.
+ */
+static void show_layer_objects_for_type(
+	struct bitmap *objects,
+	struct bitmap_index *layer,
+	struct ewah_bitmap *type_filter,
+	enum object_type object_type,
+	show_reachable_fn show_reach)
+{
+	size_t pos = 0;
+	uint32_t offset;
+
+	struct ewah_iterator it;
+	eword_t filter;
+
+	ewah_iterator_init(&it, type_filter);
+
+	while (ewah_iterator_next(&filter, &it)) {
+		for (offset = 0; offset < BITS_IN_EWORD; ++offset) {
+			struct object_id oid;
+			uint32_t index_pos;
+			off_t ofs;
+			uint32_t hash = 0;
+
+			if ((filter >> offset) == 0)
+				break;
+
+			offset += ewah_bit_ctz64(filter >> offset);
+
+			if (!bitmap_get(objects, layer->offset + pos + offset))
+				continue;
+
+			index_pos = pack_pos_to_index(layer->pack, pos + offset);
+			ofs = pack_pos_to_offset(layer->pack, pos + offset);
+			nth_packed_object_oid(&oid, layer->pack, index_pos);
+
+			if (layer->hashes)
+				hash = get_be32(layer->hashes + index_pos);
+
+			show_reach(&oid, object_type, 0, hash, layer->pack, ofs);
+		}
+
+		pos += BITS_IN_EWORD;
+	}
+}
+
 static int in_bitmapped_pack(struct object_list *roots)
 {
 	while (roots) {
 		struct object *object = roots->item;
+		unsigned int i;
+
 		roots = roots->next;
 
 		if (find_pack_entry_one(object->oid.hash, bitmap_git.pack) > 0)
 			return 1;
+
+		for (i = 0; i < bitmap_git.layers_nr; i++)
+			if (find_pack_entry_one(object->oid.hash,
+						bitmap_git.layers[i]->pack) > 0)
+				return 1;
 	}
 
 	return 0;
@@ -739,69 +951,108 @@ int prepare_bitmap_walk(struct rev_info *revs)
 	return 0;
 }
 
+/*
+ * Mark the object at position `pos` of the bitmapped pack in `reuse` if
+ * it can be sent verbatim: a delta can only be reused when its base is.
+ */
+static void try_partial_reuse(size_t pos, struct bitmap *reuse,
+			      struct pack_window **w_curs)
+{
+	struct packed_git *pack = bitmap_git.pack;
+	off_t offset, obj_offset;
+	enum object_type type;
+	unsigned long size;
+
+	if (pos >= pack->num_objects)
+		return; /* an object of a layer or an extended object */
+
+	obj_offset = offset = pack_pos_to_offset(pack, pos);
+	type = unpack_object_header(pack, w_curs, &offset, &size);
+	if (type < 0)
+		return; /* broken packfile, let the slow path complain */
+
+	if (type == OBJ_REF_DELTA || type == OBJ_OFS_DELTA) {
+		off_t base_offset;
+		uint32_t base_pos;
+
+		base_offset = get_delta_base(pack, w_curs, &offset, type,
+					     obj_offset);
+		if (!base_offset ||
+		    offset_to_pack_pos(pack, base_offset, &base_pos) < 0)
+			return;
+
+		/*
+		 * The objects are visited in pack order, so a base that
+		 * comes first is already decided on. Bases that come later
+		 * can only be REF_DELTA bases; punt on those rather than
+		 * reorder the output.
+		 */
+		if (base_pos >= pos || !bitmap_get(reuse, base_pos))
+			return;
+	}
+
+	bitmap_set(reuse, pos);
+}
+
 int reuse_partial_packfile_from_bitmap(struct packed_git **packfile,
 				       uint32_t *entries,
-				       off_t *up_to)
+				       struct bitmap **reuse_out)
 {
-	/*
-	 * Reuse the packfile content if we need more than
-	 * 90% of its objects
-	 */
-	static const double REUSE_PERCENT = 0.9;
-
 	struct bitmap *result = bitmap_git.result;
-	uint32_t reuse_threshold;
-	uint32_t i, reuse_objects = 0;
+	struct bitmap *reuse;
+	struct pack_window *w_curs = NULL;
+	size_t i = 0;
+	uint32_t offset;
 
 	assert(result);
 
-	for (i = 0; i < result->word_alloc; ++i) {
-		if (result->words[i] != (eword_t)~0) {
-			reuse_objects += ewah_bit_ctz64(~result->words[i]);
-			break;
-		}
-
-		reuse_objects += BITS_IN_EWORD;
-	}
+	if (load_pack_revindex(bitmap_git.pack))
+		return -1;
 
-#ifdef GIT_BITMAP_DEBUG
-	{
-		const unsigned char *sha1;
-		struct revindex_entry *entry;
+	/* Whole words of wanted objects at the start need no checking. */
+	while (i < result->word_alloc && result->words[i] == (eword_t)~0)
+		i++;
+	if (i > bitmap_git.pack->num_objects / BITS_IN_EWORD)
+		i = bitmap_git.pack->num_objects / BITS_IN_EWORD;
 
-		entry = &bitmap_git.reverse_index->revindex[reuse_objects];
-		sha1 = nth_packed_object_sha1(bitmap_git.pack, entry->nr);
+	reuse = bitmap_word_alloc(i);
+	memset(reuse->words, 0xFF, i * sizeof(eword_t));
 
-		fprintf(stderr, "Failed to reuse at %d (%016llx)\n",
-			reuse_objects, result->words[i]);
-		fprintf(stderr, " %s\n", sha1_to_hex(sha1));
-	}
-#endif
+	for (; i < result->word_alloc; ++i) {
+		eword_t word = result->words[i];
+		size_t pos = (i * BITS_IN_EWORD);
 
-	if (!reuse_objects)
-		return -1;
+		for (offset = 0; offset < BITS_IN_EWORD; ++offset) {
+			if ((word >> offset) == 0)
+				break;
 
-	if (reuse_objects >= bitmap_git.pack->num_objects) {
-		bitmap_git.reuse_objects = *entries = bitmap_git.pack->num_objects;
-		*up_to = -1; /* reuse the full pack */
-		*packfile = bitmap_git.pack;
-		return 0;
+			offset += ewah_bit_ctz64(word >> offset);
+			try_partial_reuse(pos + offset, reuse, &w_curs);
+		}
 	}
 
-	reuse_threshold = bitmap_popcount(bitmap_git.result) * REUSE_PERCENT;
+	unuse_pack(&w_curs);
 
-	if (reuse_objects < reuse_threshold)
+	*entries = bitmap_popcount(reuse);
+	if (!*entries) {
+		bitmap_free(reuse);
 		return -1;
+	}
 
-	bitmap_git.reuse_objects = *entries = reuse_objects;
-	*up_to = bitmap_git.pack->revindex[reuse_objects].offset;
+	/*
+	 * The reused objects are written by the caller, so the bitmap
+	 * walk must no longer show them.
+	 */
+	bitmap_and_not(result, reuse);
 	*packfile = bitmap_git.pack;
-
+	*reuse_out = reuse;
 	return 0;
 }
 
 void traverse_bitmap_commit_list(show_reachable_fn show_reachable)
 {
+	unsigned int i;
+
 	assert(bitmap_git.result);
 
 	show_objects_for_type(bitmap_git.result, bitmap_git.commits,
@@ -813,50 +1064,105 @@ void traverse_bitmap_commit_list(show_reachable_fn show_reachable)
 	show_objects_for_type(bitmap_git.result, bitmap_git.tags,
 		OBJ_TAG, show_reachable);
 
+	for (i = 0; i < bitmap_git.layers_nr; i++) {
+		struct bitmap_index *layer = bitmap_git.layers[i];
+
+		show_layer_objects_for_type(bitmap_git.result, layer,
+			layer->commits, OBJ_COMMIT, show_reachable);
+		show_layer_objects_for_type(bitmap_git.result, layer,
+			layer->trees, OBJ_TREE, show_reachable);
+		show_layer_objects_for_type(bitmap_git.result, layer,
+			layer->blobs, OBJ_BLOB, show_reachable);
+		show_layer_objects_for_type(bitmap_git.result, layer,
+			layer->tags, OBJ_TAG, show_reachable);
+	}
+
 	show_extended_objects(bitmap_git.result, show_reachable);
 
 	bitmap_free(bitmap_git.result);
 	bitmap_git.result = NULL;
 }
 
-static uint32_t count_object_type(struct bitmap *objects,
-				  enum object_type type)
+void traverse_bitmap_extended_objects(show_reachable_fn show_reachable)
 {
-	struct eindex *eindex = &bitmap_git.ext_index;
+	assert(bitmap_git.result);
 
-	uint32_t i = 0, count = 0;
-	struct ewah_iterator it;
-	eword_t filter;
+	show_extended_objects(bitmap_git.result, show_reachable);
+
+	bitmap_free(bitmap_git.result);
+	bitmap_git.result = NULL;
+}
 
+static struct ewah_bitmap *type_bitmap(struct bitmap_index *index,
+				       enum object_type type)
+{
 	switch (type) {
 	case OBJ_COMMIT:
-		ewah_iterator_init(&it, bitmap_git.commits);
-		break;
-
+		return index->commits;
 	case OBJ_TREE:
-		ewah_iterator_init(&it, bitmap_git.trees);
-		break;
-
+		return index->trees;
 	case OBJ_BLOB:
-		ewah_iterator_init(&it, bitmap_git.blobs);
-		break;
-
+		return index->blobs;
 	case OBJ_TAG:
-		ewah_iterator_init(&it, bitmap_git.tags);
-		break;
-
+		return index->tags;
 	default:
-		return 0;
+		return NULL;
+	}
+}
+
+static uint32_t count_layer_object_type(struct bitmap *objects,
+					struct bitmap_index *layer,
+					enum object_type type)
+{
+	uint32_t pos = 0, offset, count = 0;
+	struct ewah_iterator it;
+	eword_t filter;
+
+	ewah_iterator_init(&it, type_bitmap(layer, type));
+
+	while (ewah_iterator_next(&filter, &it)) {
+		for (offset = 0; offset < BITS_IN_EWORD; ++offset) {
+			if ((filter >> offset) == 0)
+				break;
+
+			offset += ewah_bit_ctz64(filter >> offset);
+
+			if (bitmap_get(objects, layer->offset + pos + offset))
+				count++;
+		}
+
+		pos += BITS_IN_EWORD;
 	}
 
+	return count;
+}
+
+static uint32_t count_object_type(struct bitmap *objects,
+				  enum object_type type)
+{
+	struct eindex *eindex = &bitmap_git.ext_index;
+
+	uint32_t i = 0, count = 0;
+	struct ewah_bitmap *type_filter = type_bitmap(&bitmap_git, type);
+	struct ewah_iterator it;
+	eword_t filter;
+
+	if (!type_filter)
+		return 0;
+
+	ewah_iterator_init(&it, type_filter);
+
 	while (i < objects->word_alloc && ewah_iterator_next(&filter, &it)) {
 		eword_t word = objects->words[i++] & filter;
 		count += ewah_bit_popcount64(word);
 	}
 
+	for (i = 0; i < bitmap_git.layers_nr; i++)
+		count += count_layer_object_type(objects, bitmap_git.layers[i], type);
+
 	for (i = 0; i < eindex->count; ++i) {
 		if (eindex->objects[i]->type == type &&
-			bitmap_get(objects, bitmap_git.pack->num_objects + i))
+			bitmap_get(objects, bitmap_git.num_objects + i))
 			count++;
 	}
 
@@ -1003,11 +1309,29 @@ static int rebuild_bitmap(uint32_t *reposition,
 	return 0;
 }
 
+static void fill_reposition(uint32_t *reposition,
+			    struct packed_git *pack,
+			    struct packing_data *mapping)
+{
+	uint32_t i;
+
+	for (i = 0; i < pack->num_objects; ++i) {
+		const unsigned char *sha1;
+		struct object_entry *oe;
+
+		sha1 = nth_packed_object_sha1(pack, pack_pos_to_index(pack, i));
+		oe = packlist_find(mapping, sha1, NULL);
+
+		if (oe)
+			reposition[i] = oe_in_pack_pos(mapping, oe) + 1;
+	}
+}
+
 int rebuild_existing_bitmaps(struct packing_data *mapping,
 			     khash_sha1 *reused_bitmaps,
 			     int show_progress)
 {
-	uint32_t i, num_objects;
+	uint32_t i;
 	uint32_t *reposition;
 	struct bitmap *rebuild;
 	struct stored_bitmap *stored;
@@ -1019,21 +1343,12 @@ int rebuild_existing_bitmaps(struct packing_data *mapping,
 	if (prepare_bitmap_git() < 0)
 		return -1;
 
-	num_objects = bitmap_git.pack->num_objects;
-	reposition = xcalloc(num_objects, sizeof(uint32_t));
-
-	for (i = 0; i < num_objects; ++i) {
-		const unsigned char *sha1;
-		struct revindex_entry *entry;
-		struct object_entry *oe;
-
-		entry = &bitmap_git.pack->revindex[i];
-		sha1 = nth_packed_object_sha1(bitmap_git.pack, entry->nr);
-		oe = packlist_find(mapping, sha1, NULL);
+	reposition = xcalloc(bitmap_git.num_objects, sizeof(uint32_t));
 
-		if (oe)
-			reposition[i] = oe->in_pack_pos + 1;
-	}
+	fill_reposition(reposition, bitmap_git.pack, mapping);
+	for (i = 0; i < bitmap_git.layers_nr; i++)
+		fill_reposition(reposition + bitmap_git.layers[i]->offset,
+				bitmap_git.layers[i]->pack, mapping);
 
 	rebuild = bitmap_new();
 	i = 0;
@@ -1063,3 +1378,89 @@ int rebuild_existing_bitmaps(struct packing_data *mapping,
 	bitmap_free(rebuild);
 	return 0;
 }
+
+int bitmap_layer_base(unsigned char *checksum)
+{
+	if (!bitmap_git.pack)
+		return -1;
+
+	if (bitmap_git.layers_nr)
+		hashcpy(checksum, bitmap_git.layers[bitmap_git.layers_nr - 1]->checksum);
+	else
+		hashcpy(checksum, bitmap_git.checksum);
+	return 0;
+}
+
+struct ewah_bitmap *bitmap_for_layer_commit(struct commit *commit,
+					    struct packing_data *mapping)
+{
+	struct eindex *eindex = &bitmap_git.ext_index;
+	struct rev_info revs;
+	struct object_list *roots = NULL;
+	struct bitmap *reachable, *layer;
+	struct ewah_bitmap *result;
+	uint32_t i, base_words;
+
+	if (prepare_bitmap_git() < 0)
+		die("BUG: bitmap layer written without a bitmap index");
+
+	init_revisions(&revs, NULL);
+	revs.tag_objects = 1;
+	revs.tree_objects = 1;
+	revs.blob_objects = 1;
+
+	reset_revision_walk();
+	object_list_insert(&commit->object, &roots);
+	reachable = find_objects(&revs, roots, NULL);
+	free(roots);
+
+	/*
+	 * Remember the result so that the walks for the descendants of
+	 * this commit can stop here. Its objects outside of the bitmapped
+	 * packs are in the extended index, whose positions stay valid as
+	 * it only ever grows.
+	 */
+	store_bitmap(&bitmap_git, bitmap_to_ewah(reachable),
+		     commit->object.oid.hash, NULL, 0);
+
+	/*
+	 * The bits of the bitmapped packs stay where they are; the objects
+	 * of the extended index move to their position in the new pack.
+	 */
+	layer = bitmap_new();
+	base_words = bitmap_git.num_objects / BITS_IN_EWORD;
+	if (base_words > reachable->word_alloc)
+		base_words = reachable->word_alloc;
+	if (base_words) {
+		/* make room for the whole words, then copy them as-is */
+		bitmap_set(layer, base_words * BITS_IN_EWORD - 1);
+		memcpy(layer->words, reachable->words,
+		       base_words * sizeof(eword_t));
+	}
+	for (i = base_words * BITS_IN_EWORD; i < bitmap_git.num_objects; i++)
+		if (bitmap_get(reachable, i))
+			bitmap_set(layer, i);
+
+	for (i = 0; i < eindex->count; i++) {
+		struct object *obj;
+		struct object_entry *entry;
+
+		if (!bitmap_get(reachable, bitmap_git.num_objects + i))
+			continue;
+
+		obj = eindex->objects[i];
+		entry = packlist_find(mapping, obj->oid.hash, NULL);
+		if (!entry)
+			die("Failed to write bitmap layer. Packfile doesn't have "
+			    "full closure (object %s is missing)",
+			    oid_to_hex(&obj->oid));
+
+		bitmap_set(layer, bitmap_git.num_objects +
+			   oe_in_pack_pos(mapping, entry));
+	}
+
+	result = bitmap_to_ewah(layer);
+	bitmap_free(layer);
+	bitmap_free(reachable);
+	return result;
+}
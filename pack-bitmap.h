@@ -15,6 +15,13 @@ struct bitmap_disk_header {
 
 static const char BITMAP_IDX_SIGNATURE[] = {'B', 'I', 'T', 'M'};
 
+/*
+ * An incremental bitmap layer (".bitmap-layer" file) covers the objects of
+ * one pack stacked on top of a bitmapped base pack and any lower layers.
+ * Its header is followed by the checksum of the pack directly below it.
+ */
+static const char BITMAP_LAYER_SIGNATURE[] = {'B', 'I', 'T', 'L'};
+
 #define NEEDS_BITMAP (1u<<22)
 
 enum pack_bitmap_opts {
@@ -37,18 +44,45 @@ typedef int (*show_reachable_fn)(
 int prepare_bitmap_git(void);
 void count_bitmap_commit_list(uint32_t *commits, uint32_t *trees, uint32_t *blobs, uint32_t *tags);
 void traverse_bitmap_commit_list(show_reachable_fn show_reachable);
+/*
+ * Like traverse_bitmap_commit_list(), but only show the objects of the
+ * last walk that are not in any bitmapped pack.
+ */
+void traverse_bitmap_extended_objects(show_reachable_fn show_reachable);
 void test_bitmap_walk(struct rev_info *revs);
 int prepare_bitmap_walk(struct rev_info *revs);
-int reuse_partial_packfile_from_bitmap(struct packed_git **packfile, uint32_t *entries, off_t *up_to);
+/*
+ * Find the objects of the last walk that can be copied verbatim from the
+ * bitmapped pack: all wanted objects of that pack except the deltas whose
+ * base is not sent along with them. Their positions in the pack are set
+ * in `*reuse`, and the walk will no longer show them.
+ */
+int reuse_partial_packfile_from_bitmap(struct packed_git **packfile,
+				       uint32_t *entries,
+				       struct bitmap **reuse);
 int rebuild_existing_bitmaps(struct packing_data *mapping, khash_sha1 *reused_bitmaps, int show_progress);
 
+/*
+ * Support for writing a bitmap layer on top of the loaded bitmaps: the
+ * checksum of the topmost bitmapped pack, which the new layer refers to,
+ * and the reachability bitmap of a commit whose objects outside of the
+ * bitmapped packs are all in "mapping".
+ */
+int bitmap_layer_base(unsigned char *checksum);
+struct ewah_bitmap *bitmap_for_layer_commit(struct commit *commit,
+					    struct packing_data *mapping);
+
 void bitmap_writer_show_progress(int show);
 void bitmap_writer_set_checksum(unsigned char *sha1);
-void bitmap_writer_build_type_index(struct pack_idx_entry **index, uint32_t index_nr);
+void bitmap_writer_set_layer_base(const unsigned char *sha1);
+void bitmap_writer_build_type_index(struct packing_data *to_pack,
+				    struct pack_idx_entry **index,
+				    uint32_t index_nr);
 void bitmap_writer_reuse_bitmaps(struct packing_data *to_pack);
 void bitmap_writer_select_commits(struct commit **indexed_commits,
 		unsigned int indexed_commits_nr, int max_bitmaps);
 void bitmap_writer_build(struct packing_data *to_pack);
+void bitmap_writer_build_layer(struct packing_data *to_pack);
 void bitmap_writer_finish(struct pack_idx_entry **index,
 			  uint32_t index_nr,
 			  const char *filename,
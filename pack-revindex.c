@@ -1,5 +1,6 @@
 #include "cache.h"
 #include "pack-revindex.h"
+#include "packfile.h"
 
 /*
  * Pack index for existing packs give us easy access to the offsets into
@@ -155,41 +156,150 @@ static void create_pack_revindex(struct packed_git *p)
 	sort_revindex(p->revindex, num_ent, p->pack_size);
 }
 
-void load_pack_revindex(struct packed_git *p)
+#define RIDX_HEADER_SIZE 12
+
+static char *pack_revindex_filename(struct packed_git *p)
 {
-	if (!p->revindex)
-		create_pack_revindex(p);
+	size_t len;
+
+	if (!strip_suffix(p->pack_name, ".pack", &len))
+		die("BUG: pack_name does not end in .pack");
+	return xstrfmt("%.*s.rev", (int)len, p->pack_name);
 }
 
-int find_revindex_position(struct packed_git *p, off_t ofs)
+/*
+ * Map the ".rev" file of "p", if there is one that matches the pack.
+ * The pack index must already be open.
+ */
+static int load_pack_revindex_from_disk(struct packed_git *p)
 {
-	int lo = 0;
-	int hi = p->num_objects + 1;
-	struct revindex_entry *revindex = p->revindex;
+	const size_t hashsz = the_hash_algo->rawsz;
+	char *rev_name = pack_revindex_filename(p);
+	const unsigned char *data;
+	size_t rev_size;
+	struct stat st;
+	int fd;
 
-	do {
-		unsigned mi = lo + (hi - lo) / 2;
-		if (revindex[mi].offset == ofs) {
-			return mi;
-		} else if (ofs < revindex[mi].offset)
-			hi = mi;
-		else
-			lo = mi + 1;
-	} while (lo < hi);
+	fd = git_open(rev_name);
+	if (fd < 0) {
+		free(rev_name);
+		return -1;
+	}
+	if (fstat(fd, &st)) {
+		close(fd);
+		free(rev_name);
+		return -1;
+	}
 
-	error("bad offset for revindex");
+	rev_size = xsize_t(st.st_size);
+	if (rev_size != RIDX_HEADER_SIZE + st_mult(4, p->num_objects) + 2 * hashsz) {
+		close(fd);
+		error("reverse-index file %s has the wrong size", rev_name);
+		free(rev_name);
+		return -1;
+	}
+
+	data = xmmap(NULL, rev_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (get_be32(data) != RIDX_SIGNATURE ||
+	    get_be32(data + 4) != RIDX_VERSION ||
+	    get_be32(data + 8) != 1) {
+		error("reverse-index file %s has an unknown signature or version",
+		      rev_name);
+		goto fail;
+	}
+
+	/* The .idx ends with the pack checksum followed by its own. */
+	if (hashcmp(data + RIDX_HEADER_SIZE + 4 * p->num_objects,
+		    (const unsigned char *)p->index_data + p->index_size - 2 * hashsz)) {
+		error("reverse-index file %s does not match its pack", rev_name);
+		goto fail;
+	}
+
+	free(rev_name);
+	p->revindex_map = data;
+	p->revindex_size = rev_size;
+	p->revindex_data = (const uint32_t *)(data + RIDX_HEADER_SIZE);
+	return 0;
+
+fail:
+	munmap((void *)data, rev_size);
+	free(rev_name);
 	return -1;
 }
 
-struct revindex_entry *find_pack_revindex(struct packed_git *p, off_t ofs)
+int load_pack_revindex(struct packed_git *p)
 {
-	int pos;
+	if (p->revindex || p->revindex_data)
+		return 0;
+
+	if (open_pack_index(p))
+		return -1;
 
-	load_pack_revindex(p);
-	pos = find_revindex_position(p, ofs);
+	if (!load_pack_revindex_from_disk(p))
+		return 0;
+	if (getenv("GIT_TEST_REV_INDEX_DIE_IN_MEMORY"))
+		die("dying as requested by 'GIT_TEST_REV_INDEX_DIE_IN_MEMORY'");
 
-	if (pos < 0)
-		return NULL;
+	create_pack_revindex(p);
+	return 0;
+}
+
+void close_pack_revindex(struct packed_git *p)
+{
+	if (!p->revindex_map)
+		return;
 
-	return p->revindex + pos;
+	munmap((void *)p->revindex_map, p->revindex_size);
+	p->revindex_map = NULL;
+	p->revindex_data = NULL;
+}
+
+uint32_t pack_pos_to_index(struct packed_git *p, uint32_t pos)
+{
+	if (p->revindex_data) {
+		uint32_t nr = get_be32(p->revindex_data + pos);
+
+		if (nr >= p->num_objects)
+			die("corrupt reverse-index for %s", p->pack_name);
+		return nr;
+	}
+	return p->revindex[pos].nr;
+}
+
+off_t pack_pos_to_offset(struct packed_git *p, uint32_t pos)
+{
+	if (p->revindex_data) {
+		/* The pack trailer follows the last object. */
+		if (pos == p->num_objects)
+			return p->pack_size - the_hash_algo->rawsz;
+		return nth_packed_object_offset(p, pack_pos_to_index(p, pos));
+	}
+	return p->revindex[pos].offset;
+}
+
+int offset_to_pack_pos(struct packed_git *p, off_t ofs, uint32_t *pos)
+{
+	uint32_t lo = 0;
+	uint32_t hi = p->num_objects + 1;
+
+	if (load_pack_revindex(p))
+		return -1;
+
+	do {
+		uint32_t mi = lo + (hi - lo) / 2;
+		off_t mi_ofs = pack_pos_to_offset(p, mi);
+
+		if (mi_ofs == ofs) {
+			*pos = mi;
+			return 0;
+		} else if (ofs < mi_ofs)
+			hi = mi;
+		else
+			lo = mi + 1;
+	} while (lo < hi);
+
+	error("bad offset for revindex");
+	return -1;
 }
@@ -1,6 +1,18 @@
 #ifndef PACK_REVINDEX_H
 #define PACK_REVINDEX_H
 
+/*
+ * A reverse index maps the objects of a pack from their position in the
+ * pack (i.e. sorted by offset, "pack order") to their position in the
+ * .idx (i.e. sorted by object name, "index order"), and back.
+ *
+ * It is either read from the ".rev" file next to the pack, when one was
+ * written, or computed in memory from the .idx.
+ */
+
+#define RIDX_SIGNATURE 0x52494458 /* "RIDX" */
+#define RIDX_VERSION 1
+
 struct packed_git;
 
 struct revindex_entry {
@@ -8,9 +20,31 @@ struct revindex_entry {
 	unsigned int nr;
 };
 
-void load_pack_revindex(struct packed_git *p);
-int find_revindex_position(struct packed_git *p, off_t ofs);
+/*
+ * Make the reverse index of "p" available, reading it from disk if
+ * possible. Returns 0 on success, or -1 if the pack index could not be
+ * opened.
+ */
+int load_pack_revindex(struct packed_git *p);
+
+/* Release an on-disk reverse index mapped by load_pack_revindex(). */
+void close_pack_revindex(struct packed_git *p);
+
+/*
+ * Store in "pos" the pack position of the object at offset "ofs" in
+ * "p". Returns 0 on success, or -1 (after printing an error) if no
+ * object starts at that offset. Loads the reverse index as needed.
+ */
+int offset_to_pack_pos(struct packed_git *p, off_t ofs, uint32_t *pos);
 
-struct revindex_entry *find_pack_revindex(struct packed_git *p, off_t ofs);
+/*
+ * Translate the pack position "pos" of an object to its position in the
+ * .idx, or to its offset in the pack. The reverse index must be loaded.
+ * For pack_pos_to_offset(), "pos" may be equal to the number of objects,
+ * in which case the offset of the pack trailer is returned, so that the
+ * size of any object is given by the offset of the next position.
+ */
+uint32_t pack_pos_to_index(struct packed_git *p, uint32_t pos);
+off_t pack_pos_to_offset(struct packed_git *p, uint32_t pos);
 
 #endif
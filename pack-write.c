@@ -175,6 +175,65 @@ const char *write_idx_file(const char *index_name, struct pack_idx_entry **objec
 	return index_name;
 }
 
+static int pack_order_cmp(const void *va, const void *vb, void *ctx)
+{
+	struct pack_idx_entry **objects = ctx;
+	off_t oa = objects[*(uint32_t *)va]->offset;
+	off_t ob = objects[*(uint32_t *)vb]->offset;
+
+	if (oa < ob)
+		return -1;
+	if (oa > ob)
+		return 1;
+	return 0;
+}
+
+/*
+ * The objects array must be sorted by name, as write_idx_file() leaves
+ * it, so that the position of an object in it is its position in the
+ * .idx file.
+ */
+const char *write_rev_file(const char *rev_name,
+			   struct pack_idx_entry **objects,
+			   uint32_t nr_objects,
+			   const unsigned char *pack_hash)
+{
+	struct hashfile *f;
+	uint32_t *pack_order;
+	uint32_t i;
+	int fd;
+
+	if (!rev_name) {
+		struct strbuf tmp_file = STRBUF_INIT;
+		fd = odb_mkstemp(&tmp_file, "pack/tmp_rev_XXXXXX");
+		rev_name = strbuf_detach(&tmp_file, NULL);
+	} else {
+		unlink(rev_name);
+		fd = open(rev_name, O_CREAT|O_EXCL|O_WRONLY, 0600);
+		if (fd < 0)
+			die_errno("unable to create '%s'", rev_name);
+	}
+	f = hashfd(fd, rev_name);
+
+	ALLOC_ARRAY(pack_order, nr_objects);
+	for (i = 0; i < nr_objects; i++)
+		pack_order[i] = i;
+	QSORT_S(pack_order, nr_objects, pack_order_cmp, objects);
+
+	hashwrite_be32(f, RIDX_SIGNATURE);
+	hashwrite_be32(f, RIDX_VERSION);
+	hashwrite_be32(f, 1); /* hash version: SHA-1 */
+
+	for (i = 0; i < nr_objects; i++)
+		hashwrite_be32(f, pack_order[i]);
+
+	hashwrite(f, pack_hash, the_hash_algo->rawsz);
+	hashclose(f, NULL, CSUM_FSYNC);
+
+	free(pack_order);
+	return rev_name;
+}
+
 off_t write_pack_header(struct hashfile *f, uint32_t nr_entries)
 {
 	struct pack_header hdr;
@@ -350,7 +409,7 @@ void finish_tmp_packfile(struct strbuf *name_buffer,
 			 struct pack_idx_option *pack_idx_opts,
 			 unsigned char sha1[])
 {
-	const char *idx_tmp_name;
+	const char *idx_tmp_name, *rev_tmp_name = NULL;
 	int basename_len = name_buffer->len;
 
 	if (adjust_shared_perm(pack_tmp_name))
@@ -361,6 +420,13 @@ void finish_tmp_packfile(struct strbuf *name_buffer,
 	if (adjust_shared_perm(idx_tmp_name))
 		die_errno("unable to make temporary index file readable");
 
+	if (pack_idx_opts->flags & WRITE_REV) {
+		rev_tmp_name = write_rev_file(NULL, written_list, nr_written,
+					      sha1);
+		if (adjust_shared_perm(rev_tmp_name))
+			die_errno("unable to make temporary reverse index file readable");
+	}
+
 	strbuf_addf(name_buffer, "%s.pack", sha1_to_hex(sha1));
 
 	if (rename(pack_tmp_name, name_buffer->buf))
@@ -368,6 +434,14 @@ void finish_tmp_packfile(struct strbuf *name_buffer,
 
 	strbuf_setlen(name_buffer, basename_len);
 
+	/* The .rev file must be in place before the .idx announces the pack. */
+	if (rev_tmp_name) {
+		strbuf_addf(name_buffer, "%s.rev", sha1_to_hex(sha1));
+		if (rename(rev_tmp_name, name_buffer->buf))
+			die_errno("unable to rename temporary reverse index file");
+		strbuf_setlen(name_buffer, basename_len);
+	}
+
 	strbuf_addf(name_buffer, "%s.idx", sha1_to_hex(sha1));
 	if (rename(idx_tmp_name, name_buffer->buf))
 		die_errno("unable to rename temporary index file");
@@ -375,4 +449,5 @@ void finish_tmp_packfile(struct strbuf *name_buffer,
 	strbuf_setlen(name_buffer, basename_len);
 
 	free((void *)idx_tmp_name);
+	free((void *)rev_tmp_name);
 }
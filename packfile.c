@@ -13,6 +13,7 @@
 #include "tag.h"
 #include "tree-walk.h"
 #include "tree.h"
+#include "midx.h"
 
 char *odb_pack_name(struct strbuf *buf,
 		    const unsigned char *sha1,
@@ -302,9 +303,11 @@ void close_pack_index(struct packed_git *p)
 		munmap((void *)p->index_data, p->index_size);
 		p->index_data = NULL;
 	}
+	/* An on-disk reverse index cannot be used without the .idx. */
+	close_pack_revindex(p);
 }
 
-static void close_pack(struct packed_git *p)
+void close_pack(struct packed_git *p)
 {
 	close_pack_windows(p);
 	close_pack_fd(p);
@@ -787,9 +790,14 @@ static void prepare_packed_git_one(char *objdir, int local)
 		if (!report_garbage)
 			continue;
 
+		if (!strcmp(de->d_name, "multi-pack-index"))
+			continue;
+
 		if (ends_with(de->d_name, ".idx") ||
 		    ends_with(de->d_name, ".pack") ||
+		    ends_with(de->d_name, ".rev") ||
 		    ends_with(de->d_name, ".bitmap") ||
+		    ends_with(de->d_name, ".bitmap-layer") ||
 		    ends_with(de->d_name, ".keep") ||
 		    ends_with(de->d_name, ".promisor"))
 			string_list_append(&garbage, path.buf);
@@ -797,6 +805,7 @@ static void prepare_packed_git_one(char *objdir, int local)
 			report_garbage(PACKDIR_FILE_GARBAGE, path.buf);
 	}
 	closedir(dir);
+	prepare_multi_pack_index_one(objdir, local);
 	report_pack_garbage(&garbage);
 	string_list_clear(&garbage, 0);
 	strbuf_release(&path);
@@ -816,11 +825,14 @@ unsigned long approximate_object_count(void)
 	static unsigned long count;
 	if (!approximate_object_count_valid) {
 		struct packed_git *p;
+		struct multi_pack_index *m;
 
 		prepare_packed_git();
 		count = 0;
+		for (m = multi_pack_index; m; m = m->next)
+			count += m->num_objects;
 		for (p = packed_git; p; p = p->next) {
-			if (open_pack_index(p))
+			if (p->multi_pack_index || open_pack_index(p))
 				continue;
 			count += p->num_objects;
 		}
@@ -893,6 +905,7 @@ void prepare_packed_git(void)
 	prepare_alt_odb();
 	for (alt = alt_odb_list; alt; alt = alt->next)
 		prepare_packed_git_one(alt->path, 0);
+	attach_midx_packs();
 	rearrange_packed_git();
 	prepare_packed_git_mru();
 	prepare_packed_git_run_once = 1;
@@ -947,7 +960,13 @@ unsigned long get_size_from_delta(struct packed_git *p,
 	do {
 		in = use_pack(p, w_curs, curpos, &stream.avail_in);
 		stream.next_in = in;
+		/*
+		 * The window stays mapped while w_curs holds it, so other
+		 * threads can use the pack while we inflate.
+		 */
+		obj_read_unlock();
 		st = git_inflate(&stream, Z_FINISH);
+		obj_read_lock();
 		curpos += stream.next_in - in;
 	} while ((st == Z_OK || st == Z_BUF_ERROR) &&
 		 stream.total_out < sizeof(delta_head));
@@ -1020,11 +1039,11 @@ const struct packed_git *has_packed_and_bad(const unsigned char *sha1)
 	return NULL;
 }
 
-static off_t get_delta_base(struct packed_git *p,
-				    struct pack_window **w_curs,
-				    off_t *curpos,
-				    enum object_type type,
-				    off_t delta_obj_offset)
+off_t get_delta_base(struct packed_git *p,
+			    struct pack_window **w_curs,
+			    off_t *curpos,
+			    enum object_type type,
+			    off_t delta_obj_offset)
 {
 	unsigned char *base_info = use_pack(p, w_curs, *curpos, NULL);
 	off_t base_offset;
@@ -1075,18 +1094,17 @@ static const unsigned char *get_delta_base_sha1(struct packed_git *p,
 		unsigned char *base = use_pack(p, w_curs, curpos, NULL);
 		return base;
 	} else if (type == OBJ_OFS_DELTA) {
-		struct revindex_entry *revidx;
+		uint32_t base_pos;
 		off_t base_offset = get_delta_base(p, w_curs, &curpos,
 						   type, delta_obj_offset);
 
 		if (!base_offset)
 			return NULL;
 
-		revidx = find_pack_revindex(p, base_offset);
-		if (!revidx)
+		if (offset_to_pack_pos(p, base_offset, &base_pos) < 0)
 			return NULL;
 
-		return nth_packed_object_sha1(p, revidx->nr);
+		return nth_packed_object_sha1(p, pack_pos_to_index(p, base_pos));
 	} else
 		return NULL;
 }
@@ -1094,12 +1112,11 @@ static const unsigned char *get_delta_base_sha1(struct packed_git *p,
 static int retry_bad_packed_offset(struct packed_git *p, off_t obj_offset)
 {
 	int type;
-	struct revindex_entry *revidx;
+	uint32_t pos;
 	const unsigned char *sha1;
-	revidx = find_pack_revindex(p, obj_offset);
-	if (!revidx)
+	if (offset_to_pack_pos(p, obj_offset, &pos) < 0)
 		return OBJ_BAD;
-	sha1 = nth_packed_object_sha1(p, revidx->nr);
+	sha1 = nth_packed_object_sha1(p, pack_pos_to_index(p, pos));
 	mark_bad_packed_object(p, sha1);
 	type = sha1_object_info(sha1, NULL);
 	if (type <= OBJ_NONE)
@@ -1176,6 +1193,11 @@ static enum object_type packed_to_object_type(struct packed_git *p,
 	goto out;
 }
 
+/*
+ * The delta base cache is only accessed with the object read lock held
+ * (see enable_obj_read_lock()). Buffers are detached from it before they
+ * are used without the lock.
+ */
 static struct hashmap delta_base_cache;
 static size_t delta_base_cached;
 
@@ -1357,8 +1379,12 @@ int packed_object_info(struct packed_git *p, off_t obj_offset,
 	}
 
 	if (oi->disk_sizep) {
-		struct revindex_entry *revidx = find_pack_revindex(p, obj_offset);
-		*oi->disk_sizep = revidx[1].offset - obj_offset;
+		uint32_t pos;
+		if (offset_to_pack_pos(p, obj_offset, &pos) < 0) {
+			type = OBJ_BAD;
+			goto out;
+		}
+		*oi->disk_sizep = pack_pos_to_offset(p, pos + 1) - obj_offset;
 	}
 
 	if (oi->typep || oi->type_name) {
@@ -1479,6 +1505,7 @@ void *unpack_entry(struct packed_git *p, off_t obj_offset,
 	int delta_stack_nr = 0, delta_stack_alloc = UNPACK_ENTRY_STACK_PREALLOC;
 	int base_from_cache = 0;
 
+	obj_read_lock();
 	write_pack_access_log(p, obj_offset);
 
 	/* PHASE 1: drill down to the innermost base object */
@@ -1498,11 +1525,18 @@ void *unpack_entry(struct packed_git *p, off_t obj_offset,
 		}
 
 		if (do_check_packed_object_crc && p->index_version > 1) {
-			struct revindex_entry *revidx = find_pack_revindex(p, obj_offset);
-			off_t len = revidx[1].offset - obj_offset;
-			if (check_pack_crc(p, &w_curs, obj_offset, len, revidx->nr)) {
+			uint32_t pack_pos, index_pos;
+			off_t len;
+
+			if (offset_to_pack_pos(p, obj_offset, &pack_pos) < 0) {
+				data = NULL;
+				goto out;
+			}
+			len = pack_pos_to_offset(p, pack_pos + 1) - obj_offset;
+			index_pos = pack_pos_to_index(p, pack_pos);
+			if (check_pack_crc(p, &w_curs, obj_offset, len, index_pos)) {
 				const unsigned char *sha1 =
-					nth_packed_object_sha1(p, revidx->nr);
+					nth_packed_object_sha1(p, index_pos);
 				error("bad packed object CRC for %s",
 				      sha1_to_hex(sha1));
 				mark_bad_packed_object(p, sha1);
@@ -1573,13 +1607,11 @@ void *unpack_entry(struct packed_git *p, off_t obj_offset,
 		void *base = data;
 		void *external_base = NULL;
 		unsigned long delta_size, base_size = size;
+		off_t base_offset = obj_offset;
 		int i;
 
 		data = NULL;
 
-		if (base)
-			add_delta_base_cache(p, obj_offset, base, base_size, type);
-
 		if (!base) {
 			/*
 			 * We're probably in deep shit, but let's try to fetch
@@ -1587,11 +1619,10 @@ void *unpack_entry(struct packed_git *p, off_t obj_offset,
 			 * This is costly but should happen only in the presence
 			 * of a corrupted pack, and is better than failing outright.
 			 */
-			struct revindex_entry *revidx;
+			uint32_t pos;
 			const unsigned char *base_sha1;
-			revidx = find_pack_revindex(p, obj_offset);
-			if (revidx) {
-				base_sha1 = nth_packed_object_sha1(p, revidx->nr);
+			if (!offset_to_pack_pos(p, obj_offset, &pos)) {
+				base_sha1 = nth_packed_object_sha1(p, pack_pos_to_index(p, pos));
 				error("failed to read delta base object %s"
 				      " at offset %"PRIuMAX" from %s",
 				      sha1_to_hex(base_sha1), (uintmax_t)obj_offset,
@@ -1617,13 +1648,27 @@ void *unpack_entry(struct packed_git *p, off_t obj_offset,
 			      "at offset %"PRIuMAX" from %s",
 			      (uintmax_t)curpos, p->pack_name);
 			data = NULL;
-			free(external_base);
+			if (external_base)
+				free(external_base);
+			else
+				add_delta_base_cache(p, base_offset, base,
+						     base_size, type);
 			continue;
 		}
 
+		/*
+		 * Nobody else can see "base" before it is added to the
+		 * delta base cache, so the delta can be applied without
+		 * holding the object read lock.
+		 */
+		obj_read_unlock();
 		data = patch_delta(base, base_size,
 				   delta_data, delta_size,
 				   &size);
+		obj_read_lock();
+
+		if (!external_base)
+			add_delta_base_cache(p, base_offset, base, base_size, type);
 
 		/*
 		 * We could not apply the delta; warn the user, but keep going.
@@ -1647,6 +1692,7 @@ void *unpack_entry(struct packed_git *p, off_t obj_offset,
 
 out:
 	unuse_pack(&w_curs);
+	obj_read_unlock();
 
 	if (delta_stack != small_delta_stack)
 		free(delta_stack);
@@ -1821,13 +1867,21 @@ static int fill_pack_entry(const unsigned char *sha1,
 int find_pack_entry(const unsigned char *sha1, struct pack_entry *e)
 {
 	struct list_head *pos;
+	struct multi_pack_index *m;
 
 	prepare_packed_git();
 	if (!packed_git)
 		return 0;
 
+	for (m = multi_pack_index; m; m = m->next) {
+		if (fill_midx_entry(sha1, e, m))
+			return 1;
+	}
+
 	list_for_each(pos, &packed_git_mru) {
 		struct packed_git *p = list_entry(pos, struct packed_git, mru);
+		if (p->multi_pack_index)
+			continue;
 		if (fill_pack_entry(sha1, e, p)) {
 			list_move(&p->mru, &packed_git_mru);
 			return 1;
@@ -1850,7 +1904,7 @@ int has_pack_index(const unsigned char *sha1)
 	return 1;
 }
 
-static int for_each_object_in_pack(struct packed_git *p, each_packed_object_fn cb, void *data)
+int for_each_object_in_pack(struct packed_git *p, each_packed_object_fn cb, void *data)
 {
 	uint32_t i;
 	int r = 0;
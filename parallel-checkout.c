@@ -0,0 +1,307 @@
+#include "cache.h"
+#include "config.h"
+#include "convert.h"
+#include "parallel-checkout.h"
+#include "thread-utils.h"
+
+enum pc_item_status {
+	PC_ITEM_PENDING = 0,
+	PC_ITEM_WRITTEN,
+	/*
+	 * The path already existed when the worker tried to create it,
+	 * most likely because another entry of the same checkout maps to
+	 * the same file on a case-insensitive filesystem.
+	 */
+	PC_ITEM_COLLIDED,
+	PC_ITEM_FAILED
+};
+
+struct parallel_checkout_item {
+	struct cache_entry *ce;
+	struct conv_attrs ca;
+	char *path;
+	enum pc_item_status status;
+	struct strbuf err;
+	struct stat st;
+	int fstat_done;
+};
+
+struct parallel_checkout {
+	struct parallel_checkout_item *items;
+	int nr, alloc;
+	int num_workers, threshold;
+	unsigned use_fstat:1;
+};
+
+#define DEFAULT_THRESHOLD_FOR_PARALLELISM 100
+
+static void get_parallel_checkout_configs(int *num_workers, int *threshold)
+{
+	int env_workers = git_env_ulong("GIT_TEST_CHECKOUT_WORKERS", 0);
+
+	if (env_workers) {
+		*num_workers = env_workers;
+		*threshold = 0;
+		return;
+	}
+
+	if (git_config_get_int("checkout.workers", num_workers))
+		*num_workers = 1;
+	else if (*num_workers < 1)
+		*num_workers = online_cpus();
+
+	if (git_config_get_int("checkout.thresholdforparallelism", threshold))
+		*threshold = DEFAULT_THRESHOLD_FOR_PARALLELISM;
+}
+
+void enable_parallel_checkout(struct checkout *state)
+{
+#ifndef NO_PTHREADS
+	struct parallel_checkout *pc;
+	int num_workers, threshold;
+
+	if (state->parallel_checkout)
+		return;
+
+	get_parallel_checkout_configs(&num_workers, &threshold);
+	if (num_workers <= 1)
+		return;
+
+	pc = xcalloc(1, sizeof(*pc));
+	pc->num_workers = num_workers;
+	pc->threshold = threshold;
+	/* same as fstat_output() in entry.c */
+	pc->use_fstat = fstat_is_reliable() &&
+			state->refresh_cache && !state->base_dir_len;
+	state->parallel_checkout = pc;
+#endif
+}
+
+int enqueue_checkout(const struct checkout *state,
+		     struct cache_entry *ce, const char *path)
+{
+	struct parallel_checkout *pc = state->parallel_checkout;
+	struct parallel_checkout_item *item;
+	struct conv_attrs ca;
+
+	if (!pc || !S_ISREG(ce->ce_mode))
+		return -1;
+
+	/*
+	 * The attributes are looked up here, as that is not thread-safe.
+	 * Filter drivers run external processes and may delay the entry,
+	 * so those entries are left to the sequential code.
+	 */
+	convert_attrs(&ca, ce->name);
+	if (ca.drv)
+		return -1;
+
+	ALLOC_GROW(pc->items, pc->nr + 1, pc->alloc);
+	item = &pc->items[pc->nr++];
+	memset(item, 0, sizeof(*item));
+	item->ce = ce;
+	item->ca = ca;
+	item->path = xstrdup(path);
+	strbuf_init(&item->err, 0);
+	return 0;
+}
+
+static void write_pc_item(struct parallel_checkout *pc,
+			  struct parallel_checkout_item *item)
+{
+	struct cache_entry *ce = item->ce;
+	enum object_type type;
+	unsigned long size;
+	void *blob;
+	struct strbuf buf = STRBUF_INIT;
+	int fd;
+	ssize_t wrote;
+
+	/*
+	 * Large blobs are streamed to the working tree by write_entry()
+	 * instead of being held in memory; leave them to it.
+	 */
+	type = sha1_object_info(ce->oid.hash, &size);
+	if (type == OBJ_BLOB && size > big_file_threshold)
+		return;
+
+	blob = read_sha1_file(ce->oid.hash, &type, &size);
+	if (!blob || type != OBJ_BLOB) {
+		free(blob);
+		strbuf_addf(&item->err, "unable to read sha1 file of %s (%s)",
+			    item->path, oid_to_hex(&ce->oid));
+		item->status = PC_ITEM_FAILED;
+		return;
+	}
+
+	if (convert_to_working_tree_ca(&item->ca, ce->name, blob, size, &buf)) {
+		size_t newsize;
+
+		free(blob);
+		blob = strbuf_detach(&buf, &newsize);
+		size = newsize;
+	}
+
+	fd = open(item->path, O_WRONLY | O_CREAT | O_EXCL,
+		  (ce->ce_mode & 0100) ? 0777 : 0666);
+	if (fd < 0) {
+		if (errno == EEXIST || errno == EISDIR) {
+			item->status = PC_ITEM_COLLIDED;
+		} else {
+			strbuf_addf(&item->err, "unable to create file %s: %s",
+				    item->path, strerror(errno));
+			item->status = PC_ITEM_FAILED;
+		}
+		free(blob);
+		return;
+	}
+
+	wrote = write_in_full(fd, blob, size);
+	if (pc->use_fstat)
+		item->fstat_done = !fstat(fd, &item->st);
+	close(fd);
+	free(blob);
+	if (wrote < 0) {
+		strbuf_addf(&item->err, "unable to write file %s", item->path);
+		item->status = PC_ITEM_FAILED;
+		return;
+	}
+	item->status = PC_ITEM_WRITTEN;
+}
+
+#ifndef NO_PTHREADS
+
+/*
+ * Workers pick the items off the queue in small chunks, so that a few
+ * large blobs do not leave the other threads idle.
+ */
+#define ITEMS_PER_CHUNK 8
+
+struct pc_worker_data {
+	pthread_t pthread;
+	struct parallel_checkout *pc;
+	pthread_mutex_t *mutex;
+	int *next;
+};
+
+static void *pc_worker(void *_data)
+{
+	struct pc_worker_data *data = _data;
+	struct parallel_checkout *pc = data->pc;
+
+	for (;;) {
+		int i, end;
+
+		pthread_mutex_lock(data->mutex);
+		i = *data->next;
+		end = i + ITEMS_PER_CHUNK;
+		if (end > pc->nr)
+			end = pc->nr;
+		*data->next = end;
+		pthread_mutex_unlock(data->mutex);
+
+		if (i >= end)
+			break;
+		for (; i < end; i++)
+			write_pc_item(pc, &pc->items[i]);
+	}
+	return NULL;
+}
+
+static void write_items_in_parallel(struct parallel_checkout *pc)
+{
+	struct pc_worker_data *data;
+	pthread_mutex_t mutex;
+	int i, err, next = 0;
+	int num_workers = pc->num_workers;
+
+	if (num_workers > DIV_ROUND_UP(pc->nr, ITEMS_PER_CHUNK))
+		num_workers = DIV_ROUND_UP(pc->nr, ITEMS_PER_CHUNK);
+
+	pthread_mutex_init(&mutex, NULL);
+	enable_obj_read_lock();
+	data = xcalloc(num_workers, sizeof(*data));
+	for (i = 0; i < num_workers; i++) {
+		data[i].pc = pc;
+		data[i].mutex = &mutex;
+		data[i].next = &next;
+		err = pthread_create(&data[i].pthread, NULL, pc_worker, &data[i]);
+		if (err)
+			die(_("unable to create checkout thread: %s"), strerror(err));
+	}
+	for (i = 0; i < num_workers; i++) {
+		err = pthread_join(data[i].pthread, NULL);
+		if (err)
+			die(_("unable to join checkout thread: %s"), strerror(err));
+	}
+	free(data);
+	disable_obj_read_lock();
+	pthread_mutex_destroy(&mutex);
+}
+
+#endif
+
+int finish_parallel_checkout(struct checkout *state)
+{
+	struct parallel_checkout *pc = state->parallel_checkout;
+	struct cache_entry **retry = NULL;
+	int i, retry_nr = 0, errs = 0;
+
+	if (!pc)
+		return 0;
+
+	/* entries that are checked out from here on are written right away */
+	state->parallel_checkout = NULL;
+
+#ifndef NO_PTHREADS
+	if (pc->nr >= pc->threshold && pc->nr > 1)
+		write_items_in_parallel(pc);
+	else
+#endif
+		for (i = 0; i < pc->nr; i++)
+			write_pc_item(pc, &pc->items[i]);
+
+	/* Flush cached lstat in fscache after writing to disk. */
+	flush_fscache();
+
+	ALLOC_ARRAY(retry, pc->nr);
+	for (i = 0; i < pc->nr; i++) {
+		struct parallel_checkout_item *item = &pc->items[i];
+
+		switch (item->status) {
+		case PC_ITEM_WRITTEN:
+			if (!state->refresh_cache)
+				break;
+			if (!item->fstat_done && lstat(item->ce->name, &item->st) < 0) {
+				errs |= error_errno("unable to stat just-written file %s",
+						    item->ce->name);
+				break;
+			}
+			update_ce_after_write(state, item->ce, &item->st);
+			break;
+		case PC_ITEM_FAILED:
+			errs |= error("%s", item->err.buf);
+			break;
+		case PC_ITEM_PENDING:
+		case PC_ITEM_COLLIDED:
+			retry[retry_nr++] = item->ce;
+			break;
+		}
+		strbuf_release(&item->err);
+		free(item->path);
+	}
+
+	/*
+	 * Write the entries the workers left alone with the sequential
+	 * code.  For colliding paths this overwrites what another entry
+	 * wrote, like the sequential code would have done, although which
+	 * of the entries ends up in the working tree may differ.
+	 */
+	for (i = 0; i < retry_nr; i++)
+		errs |= checkout_entry(retry[i], state, NULL);
+
+	free(retry);
+	free(pc->items);
+	free(pc);
+	return errs;
+}
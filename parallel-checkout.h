@@ -0,0 +1,29 @@
+#ifndef PARALLEL_CHECKOUT_H
+#define PARALLEL_CHECKOUT_H
+
+struct cache_entry;
+struct checkout;
+
+/*
+ * Parallel checkout defers the writing of regular files by
+ * checkout_entry() to a pool of threads, which read the blobs, convert
+ * them to their working tree form and write them out concurrently.
+ *
+ * enable_parallel_checkout() prepares "state" for it, if the number of
+ * workers configured by checkout.workers is larger than one.  Entries
+ * queued by checkout_entry() are only written once
+ * finish_parallel_checkout() is called, which must happen before the
+ * index is used again and before finish_delayed_checkout().
+ */
+extern void enable_parallel_checkout(struct checkout *state);
+extern int finish_parallel_checkout(struct checkout *state);
+
+/*
+ * Queue "ce" to be written to "path" by a worker.  Returns 0 if the
+ * entry was queued, or -1 if it has to be checked out by the caller,
+ * e.g. because its content goes through a filter driver.
+ */
+extern int enqueue_checkout(const struct checkout *state,
+			    struct cache_entry *ce, const char *path);
+
+#endif /* PARALLEL_CHECKOUT_H */
@@ -29,6 +29,8 @@
 #include "quote.h"
 #include "packfile.h"
 #include "fetch-object.h"
+#include "thread-utils.h"
+#include "oidmap.h"
 
 const unsigned char null_sha1[GIT_MAX_RAWSZ];
 const struct object_id null_oid;
@@ -1201,8 +1203,11 @@ static int sha1_loose_object_info(const unsigned char *sha1,
 		status = error("unable to parse %s header", sha1_to_hex(sha1));
 
 	if (status >= 0 && oi->contentp) {
+		/* The mapping is ours alone; let other readers go on. */
+		obj_read_unlock();
 		*oi->contentp = unpack_sha1_rest(&stream, hdr,
 						 *oi->sizep, sha1);
+		obj_read_lock();
 		if (!*oi->contentp) {
 			git_inflate_end(&stream);
 			status = -1;
@@ -1222,7 +1227,62 @@ static int sha1_loose_object_info(const unsigned char *sha1,
 
 int fetch_if_missing = 1;
 
-int sha1_object_info_extended(const unsigned char *sha1, struct object_info *oi, unsigned flags)
+#ifndef NO_PTHREADS
+static pthread_mutex_t obj_read_mutex;
+static int obj_read_use_lock;
+
+void enable_obj_read_lock(void)
+{
+	if (obj_read_use_lock)
+		return;
+
+	obj_read_use_lock = 1;
+	init_recursive_mutex(&obj_read_mutex);
+}
+
+void disable_obj_read_lock(void)
+{
+	if (!obj_read_use_lock)
+		return;
+
+	obj_read_use_lock = 0;
+	pthread_mutex_destroy(&obj_read_mutex);
+}
+
+void obj_read_lock(void)
+{
+	if (obj_read_use_lock)
+		pthread_mutex_lock(&obj_read_mutex);
+}
+
+void obj_read_unlock(void)
+{
+	if (obj_read_use_lock)
+		pthread_mutex_unlock(&obj_read_mutex);
+}
+#else
+void enable_obj_read_lock(void)
+{
+}
+
+void disable_obj_read_lock(void)
+{
+}
+
+void obj_read_lock(void)
+{
+}
+
+void obj_read_unlock(void)
+{
+}
+#endif
+
+static int async_object_info(const unsigned char *sha1,
+			     struct object_info *oi);
+
+static int do_sha1_object_info_extended(const unsigned char *sha1,
+					struct object_info *oi, unsigned flags)
 {
 	static struct object_info blank_oi = OBJECT_INFO_INIT;
 	struct pack_entry e;
@@ -1238,6 +1298,9 @@ int sha1_object_info_extended(const unsigned char *sha1, struct object_info *oi,
 	if (!oi)
 		oi = &blank_oi;
 
+	if (!async_object_info(real, oi))
+		return 0;
+
 	if (!(flags & OBJECT_INFO_SKIP_CACHED)) {
 		struct cached_object *co = find_cached_object(real);
 		if (co) {
@@ -1297,7 +1360,7 @@ int sha1_object_info_extended(const unsigned char *sha1, struct object_info *oi,
 	rtype = packed_object_info(e.p, e.offset, oi);
 	if (rtype < 0) {
 		mark_bad_packed_object(e.p, real);
-		return sha1_object_info_extended(real, oi, 0);
+		return do_sha1_object_info_extended(real, oi, 0);
 	} else if (oi->whence == OI_PACKED) {
 		oi->u.packed.offset = e.offset;
 		oi->u.packed.pack = e.p;
@@ -1308,6 +1371,16 @@ int sha1_object_info_extended(const unsigned char *sha1, struct object_info *oi,
 	return 0;
 }
 
+int sha1_object_info_extended(const unsigned char *sha1, struct object_info *oi, unsigned flags)
+{
+	int ret;
+
+	obj_read_lock();
+	ret = do_sha1_object_info_extended(sha1, oi, flags);
+	obj_read_unlock();
+	return ret;
+}
+
 /* returns enum object_type or negative */
 int sha1_object_info(const unsigned char *sha1, unsigned long *sizep)
 {
@@ -1368,14 +1441,22 @@ void *read_sha1_file_extended(const unsigned char *sha1,
 	const struct packed_git *p;
 	const char *path;
 	struct stat st;
-	const unsigned char *repl = lookup_replace ? lookup_replace_object(sha1)
-						   : sha1;
+	const unsigned char *repl;
 
+	obj_read_lock();
+	repl = lookup_replace ? lookup_replace_object(sha1) : sha1;
+	obj_read_unlock();
+
+	/*
+	 * Do not hold the lock while reading the object, so that it can
+	 * be released while the object is inflated.
+	 */
 	errno = 0;
 	data = read_object(repl, type, size);
 	if (data)
 		return data;
 
+	obj_read_lock();
 	if (errno && errno != ENOENT)
 		die_errno("failed to read object %s", sha1_to_hex(sha1));
 
@@ -1391,6 +1472,7 @@ void *read_sha1_file_extended(const unsigned char *sha1,
 	if ((p = has_packed_and_bad(repl)) != NULL)
 		die("packed object %s (stored in %s) is corrupt",
 		    sha1_to_hex(repl), p->pack_name);
+	obj_read_unlock();
 
 	return NULL;
 }
@@ -1443,6 +1525,119 @@ void *read_object_with_reference(const unsigned char *sha1,
 	}
 }
 
+struct read_batch {
+	struct object_read_request **sorted;
+	size_t nr;
+	size_t next;
+#ifndef NO_PTHREADS
+	pthread_mutex_t mutex;
+#endif
+};
+
+static int compare_read_requests(const void *a_, const void *b_)
+{
+	const struct object_read_request *a =
+		*(const struct object_read_request **)a_;
+	const struct object_read_request *b =
+		*(const struct object_read_request **)b_;
+
+	if (a->pack != b->pack) {
+		/* loose objects go last */
+		if (!a->pack)
+			return 1;
+		if (!b->pack)
+			return -1;
+		return strcmp(a->pack->pack_name, b->pack->pack_name);
+	}
+	if (a->offset < b->offset)
+		return -1;
+	return a->offset > b->offset;
+}
+
+static struct object_read_request *next_read_request(struct read_batch *batch)
+{
+	struct object_read_request *req = NULL;
+
+#ifndef NO_PTHREADS
+	pthread_mutex_lock(&batch->mutex);
+#endif
+	if (batch->next < batch->nr)
+		req = batch->sorted[batch->next++];
+#ifndef NO_PTHREADS
+	pthread_mutex_unlock(&batch->mutex);
+#endif
+	return req;
+}
+
+static void *read_batch_worker(void *data)
+{
+	struct read_batch *batch = data;
+	struct object_read_request *req;
+
+	while ((req = next_read_request(batch)))
+		req->buf = read_sha1_file(req->oid.hash, &req->type,
+					  &req->size);
+	return NULL;
+}
+
+void read_object_batch(struct object_read_request *req, size_t nr,
+		       int nr_threads)
+{
+	struct read_batch batch;
+	size_t i;
+
+	/*
+	 * Find where each object lives, so that the workers can take
+	 * them in pack order and read each pack front to back.
+	 */
+	ALLOC_ARRAY(batch.sorted, nr);
+	for (i = 0; i < nr; i++) {
+		struct pack_entry e;
+
+		req[i].buf = NULL;
+		if (find_pack_entry(lookup_replace_object(req[i].oid.hash), &e)) {
+			req[i].pack = e.p;
+			req[i].offset = e.offset;
+		} else {
+			req[i].pack = NULL;
+			req[i].offset = 0;
+		}
+		batch.sorted[i] = &req[i];
+	}
+	QSORT(batch.sorted, nr, compare_read_requests);
+	batch.nr = nr;
+	batch.next = 0;
+
+#ifndef NO_PTHREADS
+	pthread_mutex_init(&batch.mutex, NULL);
+	if (nr_threads > 1 && nr > 1) {
+		pthread_t *threads;
+		int t;
+
+		if (nr_threads > nr)
+			nr_threads = nr;
+		ALLOC_ARRAY(threads, nr_threads);
+		enable_obj_read_lock();
+		for (t = 0; t < nr_threads; t++) {
+			int err = pthread_create(&threads[t], NULL,
+						 read_batch_worker, &batch);
+			if (err)
+				die(_("unable to create thread: %s"),
+				    strerror(err));
+		}
+		for (t = 0; t < nr_threads; t++)
+			pthread_join(threads[t], NULL);
+		disable_obj_read_lock();
+		free(threads);
+	} else
+		read_batch_worker(&batch);
+	pthread_mutex_destroy(&batch.mutex);
+#else
+	read_batch_worker(&batch);
+#endif
+	free(batch.sorted);
+}
+
 static void write_object_file_prepare(const void *buf, unsigned long len,
 				      const char *type, struct object_id *oid,
 				      char *hdr, int *hdrlen)
@@ -1581,18 +1776,18 @@ static int write_loose_object(const struct object_id *oid, char *hdr,
 	git_zstream stream;
 	git_hash_ctx c;
 	struct object_id parano_oid;
-	static struct strbuf tmp_file = STRBUF_INIT;
-	static struct strbuf filename = STRBUF_INIT;
+	struct strbuf tmp_file = STRBUF_INIT;
+	struct strbuf filename = STRBUF_INIT;
 
-	strbuf_reset(&filename);
 	sha1_file_name(&filename, oid->hash);
 
 	fd = create_tmpfile(&tmp_file, filename.buf);
 	if (fd < 0) {
 		if (errno == EACCES)
-			return error("insufficient permission for adding an object to repository database %s", get_object_directory());
+			ret = error("insufficient permission for adding an object to repository database %s", get_object_directory());
 		else
-			return error_errno("unable to create temporary file");
+			ret = error_errno("unable to create temporary file");
+		goto out;
 	}
 
 	/* Set it up */
@@ -1643,7 +1838,11 @@ static int write_loose_object(const struct object_id *oid, char *hdr,
 			warning_errno("failed utime() on %s", tmp_file.buf);
 	}
 
-	return finalize_object_file(tmp_file.buf, filename.buf);
+	ret = finalize_object_file(tmp_file.buf, filename.buf);
+out:
+	strbuf_release(&tmp_file);
+	strbuf_release(&filename);
+	return ret;
 }
 
 static int freshen_loose_object(const unsigned char *sha1)
@@ -1679,6 +1878,221 @@ int write_object_file(const void *buf, unsigned long len, const char *type,
 	return write_loose_object(oid, hdr, hdrlen, buf, len, 0);
 }
 
+/*
+ * Loose objects queued by write_object_file_async() are compressed and
+ * written out by a pool of writer threads. Until an object is on disk,
+ * it stays in the "pending" map, from which it can be read back.
+ */
+#ifndef NO_PTHREADS
+#define MAX_ASYNC_BYTES (64 * 1024 * 1024)
+
+struct async_object {
+	struct oidmap_entry entry;
+	enum object_type type;
+	void *buf;
+	unsigned long size;
+	struct async_object *next;
+};
+
+static struct {
+	int nr_threads;
+	pthread_t *threads;
+	pthread_mutex_t mutex;
+	pthread_cond_t work_cond;
+	pthread_cond_t space_cond;
+	struct async_object *head, **tail;
+	struct oidmap pending;
+	unsigned long pending_bytes;
+	int finishing;
+	int errors;
+} async_writes;
+
+static void *async_object_writer(void *data)
+{
+	pthread_mutex_lock(&async_writes.mutex);
+	for (;;) {
+		struct async_object *obj;
+		char hdr[32];
+		int hdrlen;
+
+		while (!async_writes.head && !async_writes.finishing)
+			pthread_cond_wait(&async_writes.work_cond,
+					  &async_writes.mutex);
+		obj = async_writes.head;
+		if (!obj)
+			break;
+		async_writes.head = obj->next;
+		if (!async_writes.head)
+			async_writes.tail = &async_writes.head;
+		pthread_mutex_unlock(&async_writes.mutex);
+
+		hdrlen = xsnprintf(hdr, sizeof(hdr), "%s %lu",
+				   type_name(obj->type), obj->size) + 1;
+		if (write_loose_object(&obj->entry.oid, hdr, hdrlen,
+				       obj->buf, obj->size, 0) < 0) {
+			pthread_mutex_lock(&async_writes.mutex);
+			async_writes.errors++;
+			pthread_mutex_unlock(&async_writes.mutex);
+		}
+
+		pthread_mutex_lock(&async_writes.mutex);
+		oidmap_remove(&async_writes.pending, &obj->entry.oid);
+		async_writes.pending_bytes -= obj->size;
+		pthread_cond_signal(&async_writes.space_cond);
+		free(obj->buf);
+		free(obj);
+	}
+	pthread_mutex_unlock(&async_writes.mutex);
+	return NULL;
+}
+
+void start_async_object_writes(int nr_threads)
+{
+	int i;
+
+	if (nr_threads <= 1 || async_writes.nr_threads)
+		return;
+
+	/* read lazily-loaded settings before the writers need them */
+	get_shared_repository();
+
+	async_writes.nr_threads = nr_threads;
+	ALLOC_ARRAY(async_writes.threads, nr_threads);
+	pthread_mutex_init(&async_writes.mutex, NULL);
+	pthread_cond_init(&async_writes.work_cond, NULL);
+	pthread_cond_init(&async_writes.space_cond, NULL);
+	async_writes.head = NULL;
+	async_writes.tail = &async_writes.head;
+	oidmap_init(&async_writes.pending, 0);
+	async_writes.pending_bytes = 0;
+	async_writes.finishing = 0;
+	async_writes.errors = 0;
+
+	for (i = 0; i < nr_threads; i++) {
+		int err = pthread_create(&async_writes.threads[i], NULL,
+					 async_object_writer, NULL);
+		if (err)
+			die(_("unable to create thread: %s"), strerror(err));
+	}
+}
+
+int finish_async_object_writes(void)
+{
+	int i, errors;
+
+	if (!async_writes.nr_threads)
+		return 0;
+
+	pthread_mutex_lock(&async_writes.mutex);
+	async_writes.finishing = 1;
+	pthread_cond_broadcast(&async_writes.work_cond);
+	pthread_mutex_unlock(&async_writes.mutex);
+
+	for (i = 0; i < async_writes.nr_threads; i++)
+		pthread_join(async_writes.threads[i], NULL);
+
+	errors = async_writes.errors;
+	FREE_AND_NULL(async_writes.threads);
+	oidmap_free(&async_writes.pending, 0);
+	pthread_cond_destroy(&async_writes.space_cond);
+	pthread_cond_destroy(&async_writes.work_cond);
+	pthread_mutex_destroy(&async_writes.mutex);
+	async_writes.nr_threads = 0;
+
+	return errors ? -1 : 0;
+}
+
+int write_object_file_async(const void *buf, unsigned long len,
+			    const char *type, struct object_id *oid)
+{
+	char hdr[32];
+	int hdrlen = sizeof(hdr);
+	struct async_object *obj;
+	int pending;
+
+	if (!async_writes.nr_threads)
+		return write_object_file(buf, len, type, oid);
+
+	write_object_file_prepare(buf, len, type, oid, hdr, &hdrlen);
+
+	pthread_mutex_lock(&async_writes.mutex);
+	pending = !!oidmap_get(&async_writes.pending, oid);
+	pthread_mutex_unlock(&async_writes.mutex);
+	if (pending ||
+	    freshen_packed_object(oid->hash) || freshen_loose_object(oid->hash))
+		return 0;
+
+	obj = xmalloc(sizeof(*obj));
+	oidcpy(&obj->entry.oid, oid);
+	obj->type = type_from_string(type);
+	obj->buf = xmemdupz(buf, len);
+	obj->size = len;
+	obj->next = NULL;
+
+	pthread_mutex_lock(&async_writes.mutex);
+	while (async_writes.pending_bytes > MAX_ASYNC_BYTES)
+		pthread_cond_wait(&async_writes.space_cond,
+				  &async_writes.mutex);
+	oidmap_put(&async_writes.pending, obj);
+	async_writes.pending_bytes += len;
+	*async_writes.tail = obj;
+	async_writes.tail = &obj->next;
+	pthread_cond_signal(&async_writes.work_cond);
+	pthread_mutex_unlock(&async_writes.mutex);
+	return 0;
+}
+
+static int async_object_info(const unsigned char *sha1, struct object_info *oi)
+{
+	struct async_object *obj;
+	struct object_id oid;
+
+	if (!async_writes.nr_threads)
+		return -1;
+
+	hashcpy(oid.hash, sha1);
+	pthread_mutex_lock(&async_writes.mutex);
+	obj = oidmap_get(&async_writes.pending, &oid);
+	if (obj) {
+		if (oi->typep)
+			*(oi->typep) = obj->type;
+		if (oi->sizep)
+			*(oi->sizep) = obj->size;
+		if (oi->disk_sizep)
+			*(oi->disk_sizep) = 0;
+		if (oi->delta_base_sha1)
+			hashclr(oi->delta_base_sha1);
+		if (oi->type_name)
+			strbuf_addstr(oi->type_name, type_name(obj->type));
+		if (oi->contentp)
+			*oi->contentp = xmemdupz(obj->buf, obj->size);
+		oi->whence = OI_LOOSE;
+	}
+	pthread_mutex_unlock(&async_writes.mutex);
+	return obj ? 0 : -1;
+}
+#else
+void start_async_object_writes(int nr_threads)
+{
+}
+
+int finish_async_object_writes(void)
+{
+	return 0;
+}
+
+int write_object_file_async(const void *buf, unsigned long len,
+			    const char *type, struct object_id *oid)
+{
+	return write_object_file(buf, len, type, oid);
+}
+
+static int async_object_info(const unsigned char *sha1, struct object_info *oi)
+{
+	return -1;
+}
+#endif
+
 int hash_object_file_literally(const void *buf, unsigned long len,
 			       const char *type, struct object_id *oid,
 			       unsigned flags)
@@ -1757,7 +2171,7 @@ static void check_commit(const void *buf, size_t size)
 {
 	struct commit c;
 	memset(&c, 0, sizeof(c));
-	if (parse_commit_buffer(&c, buf, size))
+	if (parse_commit_buffer(&c, buf, size, 0))
 		die("corrupt commit");
 }
 
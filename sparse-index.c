@@ -0,0 +1,305 @@
+#include "cache.h"
+#include "config.h"
+#include "cache-tree.h"
+#include "dir.h"
+#include "pathspec.h"
+#include "sparse-index.h"
+#include "tree.h"
+#include "unpack-trees.h"
+
+int command_requires_full_index = 1;
+
+int sparse_checkout_patterns_sha1(unsigned char *sha1)
+{
+	struct strbuf sb = STRBUF_INIT;
+	git_hash_ctx c;
+
+	if (strbuf_read_file(&sb, git_path("info/sparse-checkout"), 0) < 0)
+		return -1;
+	the_hash_algo->init_fn(&c);
+	the_hash_algo->update_fn(&c, sb.buf, sb.len);
+	the_hash_algo->final_fn(sha1, &c);
+	strbuf_release(&sb);
+	return 0;
+}
+
+static int index_may_be_sparse(struct index_state *istate)
+{
+	int val;
+
+	if (istate->split_index || istate->drop_cache_tree)
+		return 0;
+	if (git_config_get_bool("index.sparse", &val) || !val)
+		return 0;
+	if (git_config_get_bool("core.sparsecheckout", &val) || !val)
+		return 0;
+	return 1;
+}
+
+/*
+ * The name hash points at entries that were freed or moved; have it
+ * rebuilt the next time it is needed.
+ */
+static void reset_name_hash(struct index_state *istate)
+{
+	int i;
+
+	if (!istate->name_hash_initialized)
+		return;
+	for (i = 0; i < istate->cache_nr; i++)
+		istate->cache[i]->ce_flags &= ~CE_HASHED;
+	free_name_hash(istate);
+}
+
+static struct cache_entry *make_sparse_dir_entry(const struct strbuf *path,
+						 const struct object_id *oid)
+{
+	struct cache_entry *ce = xcalloc(1, cache_entry_size(path->len));
+
+	ce->ce_mode = S_IFDIR;
+	ce->ce_flags = create_ce_flags(0) | CE_SKIP_WORKTREE;
+	ce->ce_namelen = path->len;
+	oidcpy(&ce->oid, oid);
+	memcpy(ce->name, path->buf, path->len);
+	return ce;
+}
+
+static int can_collapse(struct index_state *istate, int start, int end)
+{
+	int i;
+
+	for (i = start; i < end; i++) {
+		const struct cache_entry *ce = istate->cache[i];
+
+		if (ce_stage(ce) || S_ISGITLINK(ce->ce_mode) ||
+		    !(ce->ce_flags & CE_SKIP_WORKTREE) ||
+		    !(ce->ce_flags & CE_NEW_SKIP_WORKTREE))
+			return 0;
+	}
+	return 1;
+}
+
+/*
+ * Collapse the entries istate->cache[start..end), which make up the
+ * directory "path" described by "ct", moving what is left of them down
+ * to istate->cache[nr...].  Returns the new number of entries.
+ */
+static int convert_to_sparse_rec(struct index_state *istate, int nr,
+				 int start, int end, struct strbuf *path,
+				 struct cache_tree *ct)
+{
+	int i, nr_start = nr;
+
+	if (path->len && can_collapse(istate, start, end)) {
+		struct cache_entry *ce = istate->cache[start];
+
+		if (end - start != 1 || !S_ISSPARSEDIR(ce->ce_mode)) {
+			ce = make_sparse_dir_entry(path, &ct->oid);
+			for (i = start; i < end; i++)
+				free(istate->cache[i]);
+		}
+		istate->cache[nr++] = ce;
+
+		for (i = 0; i < ct->subtree_nr; i++) {
+			cache_tree_free(&ct->down[i]->cache_tree);
+			free(ct->down[i]);
+		}
+		ct->subtree_nr = 0;
+		ct->entry_count = 1;
+		return nr;
+	}
+
+	i = start;
+	while (i < end) {
+		struct cache_entry *ce = istate->cache[i];
+		const char *name = ce->name + path->len;
+		const char *slash = strchr(name, '/');
+		struct cache_tree *sub;
+		int pos = -1, span;
+
+		if (slash)
+			pos = cache_tree_subtree_pos(ct, name, slash - name);
+		if (!slash || pos < 0 ||
+		    (sub = ct->down[pos]->cache_tree)->entry_count <= 0) {
+			istate->cache[nr++] = ce;
+			i++;
+			continue;
+		}
+
+		span = sub->entry_count;
+		strbuf_add(path, name, slash - name + 1);
+		nr = convert_to_sparse_rec(istate, nr, i, i + span, path, sub);
+		strbuf_setlen(path, path->len - (slash - name + 1));
+		i += span;
+	}
+	ct->entry_count = nr - nr_start;
+	return nr;
+}
+
+void convert_to_sparse(struct index_state *istate)
+{
+	struct exclude_list el;
+	struct strbuf path = STRBUF_INIT;
+	unsigned char sha1[GIT_MAX_RAWSZ];
+	int i;
+
+	if (!index_may_be_sparse(istate) ||
+	    sparse_checkout_patterns_sha1(sha1) < 0) {
+		ensure_full_index(istate);
+		return;
+	}
+
+	/*
+	 * The sparse directories were only known to be outside of the
+	 * sparse checkout as it was defined when they were collapsed.
+	 */
+	if (istate->sparse_index &&
+	    hashcmp(sha1, istate->sparse_checkout_sha1))
+		ensure_full_index(istate);
+
+	/*
+	 * Each sparse directory takes the name of its tree from the
+	 * cache-tree, which has to be complete for that; an index with
+	 * unmerged entries, for example, is left alone.
+	 */
+	for (i = 0; i < istate->cache_nr; i++)
+		if (istate->cache[i]->ce_flags & CE_REMOVE)
+			return;
+	if (!istate->cache_tree)
+		istate->cache_tree = cache_tree();
+	if (cache_tree_update(istate, WRITE_TREE_SILENT))
+		return;
+
+	memset(&el, 0, sizeof(el));
+	if (add_excludes_from_file_to_list(git_path("info/sparse-checkout"),
+					   "", 0, &el, NULL) < 0) {
+		ensure_full_index(istate);
+		return;
+	}
+	mark_new_skip_worktree(&el, istate, 0, CE_NEW_SKIP_WORKTREE);
+	clear_exclude_list(&el);
+
+	istate->cache_nr = convert_to_sparse_rec(istate, 0, 0, istate->cache_nr,
+						 &path, istate->cache_tree);
+	strbuf_release(&path);
+
+	istate->sparse_index = 0;
+	for (i = 0; i < istate->cache_nr; i++) {
+		struct cache_entry *ce = istate->cache[i];
+
+		ce->ce_flags &= ~CE_NEW_SKIP_WORKTREE;
+		if (S_ISSPARSEDIR(ce->ce_mode))
+			istate->sparse_index = 1;
+	}
+	hashcpy(istate->sparse_checkout_sha1, sha1);
+	reset_name_hash(istate);
+}
+
+struct expand_data {
+	struct cache_entry **cache;
+	unsigned int nr, alloc;
+};
+
+static int add_path_to_index(const unsigned char *sha1, struct strbuf *base,
+			     const char *path, unsigned int mode, int stage,
+			     void *context)
+{
+	struct expand_data *data = context;
+	struct cache_entry *ce;
+	size_t len;
+
+	if (S_ISDIR(mode))
+		return READ_TREE_RECURSIVE;
+
+	len = base->len + strlen(path);
+	ce = xcalloc(1, cache_entry_size(len));
+	ce->ce_mode = create_ce_mode(mode);
+	ce->ce_flags = create_ce_flags(stage) | CE_SKIP_WORKTREE;
+	ce->ce_namelen = len;
+	hashcpy(ce->oid.hash, sha1);
+	memcpy(ce->name, base->buf, base->len);
+	memcpy(ce->name + base->len, path, len - base->len);
+
+	ALLOC_GROW(data->cache, data->nr + 1, data->alloc);
+	data->cache[data->nr++] = ce;
+	return 0;
+}
+
+void ensure_full_index(struct index_state *istate)
+{
+	struct expand_data data;
+	struct pathspec ps;
+	int i;
+
+	if (!istate->sparse_index)
+		return;
+
+	memset(&ps, 0, sizeof(ps));
+	data.nr = 0;
+	data.alloc = istate->cache_alloc;
+	ALLOC_ARRAY(data.cache, data.alloc);
+
+	for (i = 0; i < istate->cache_nr; i++) {
+		struct cache_entry *ce = istate->cache[i];
+		struct tree *tree;
+
+		if (!S_ISSPARSEDIR(ce->ce_mode)) {
+			ALLOC_GROW(data.cache, data.nr + 1, data.alloc);
+			data.cache[data.nr++] = ce;
+			continue;
+		}
+
+		tree = parse_tree_indirect(&ce->oid);
+		if (!tree ||
+		    read_tree_recursive(tree, ce->name, ce_namelen(ce), 0,
+					&ps, add_path_to_index, &data))
+			die(_("unable to expand sparse directory '%s'"),
+			    ce->name);
+		cache_tree_expand_sparse_dir(istate, ce->name, tree);
+		free(ce);
+	}
+
+	free(istate->cache);
+	istate->cache = data.cache;
+	istate->cache_nr = data.nr;
+	istate->cache_alloc = data.alloc;
+	istate->sparse_index = 0;
+	reset_name_hash(istate);
+}
+
+void expand_index_for_pathspec(struct index_state *istate,
+			       const struct pathspec *pathspec)
+{
+	int i, j;
+
+	if (!istate->sparse_index)
+		return;
+
+	for (i = 0; i < pathspec->nr; i++) {
+		const struct pathspec_item *item = &pathspec->items[i];
+
+		for (j = 0; j < istate->cache_nr; j++) {
+			const struct cache_entry *ce = istate->cache[j];
+			int len = ce_namelen(ce);
+
+			if (!S_ISSPARSEDIR(ce->ce_mode))
+				continue;
+			/*
+			 * A literal pathspec that names the directory or
+			 * one of its parents matches the sparse directory
+			 * as a whole; only one that reaches into it, or a
+			 * wildcard that may, needs its entries.
+			 */
+			if (item->nowildcard_len < item->len) {
+				if (len > item->nowildcard_len)
+					len = item->nowildcard_len;
+			} else if (item->len < len) {
+				continue;
+			}
+			if (!ps_strncmp(item, item->match, ce->name, len)) {
+				ensure_full_index(istate);
+				return;
+			}
+		}
+	}
+}
@@ -0,0 +1,48 @@
+#ifndef SPARSE_INDEX_H
+#define SPARSE_INDEX_H
+
+struct index_state;
+struct pathspec;
+
+/*
+ * With index.sparse and a sparse checkout, the index is written with
+ * every directory whose entries are all outside of the sparse checkout
+ * collapsed into a single "sparse directory" entry (see S_ISSPARSEDIR()),
+ * so that commands working on the checked out part of the tree do not
+ * pay for the size of the rest of it.
+ *
+ * Only commands that are marked as able to cope with such entries see
+ * them; for everybody else read_index() expands the index back to its
+ * full form.  This variable is cleared by git.c for those commands.
+ */
+extern int command_requires_full_index;
+
+/*
+ * Collapse the directories of "istate" that lie entirely outside of the
+ * sparse checkout, if index.sparse allows it.  If the index cannot be
+ * sparse anymore, e.g. because the sparse checkout was disabled, it is
+ * expanded instead.
+ */
+void convert_to_sparse(struct index_state *istate);
+
+/*
+ * Replace every sparse directory entry of "istate" by the entries of its
+ * tree.  This is a no-op for an index that is not sparse.
+ */
+void ensure_full_index(struct index_state *istate);
+
+/*
+ * Expand "istate" if one of the items of "pathspec" may match a path
+ * inside one of its sparse directories.
+ */
+void expand_index_for_pathspec(struct index_state *istate,
+			       const struct pathspec *pathspec);
+
+/*
+ * Compute the hash of $GIT_DIR/info/sparse-checkout into "sha1", which a
+ * sparse index records to tell whether its sparse directories are still
+ * outside of the sparse checkout.  Returns -1 if the file cannot be read.
+ */
+int sparse_checkout_patterns_sha1(unsigned char *sha1);
+
+#endif
@@ -0,0 +1,19 @@
+#include "cache.h"
+#include "sparse-index.h"
+
+int cmd_main(int ac, const char **av)
+{
+	int i;
+
+	setup_git_directory();
+	command_requires_full_index = 0;
+	if (read_cache() < 0)
+		die("unable to read index file");
+	printf("%s\n", the_index.sparse_index ? "sparse" : "full");
+	for (i = 0; i < the_index.cache_nr; i++) {
+		struct cache_entry *ce = the_index.cache[i];
+		printf("%06o %s %d\t%s\n", ce->ce_mode,
+		       oid_to_hex(&ce->oid), ce_stage(ce), ce->name);
+	}
+	return 0;
+}
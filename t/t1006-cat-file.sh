@@ -573,4 +573,40 @@ test_expect_success 'cat-file --batch-all-objects shows all objects' '
 	test_cmp expect actual
 '
 
+test_expect_success 'setup objects for --batch --threads' '
+	git rev-list --objects --all >objects &&
+	{
+		cut -d" " -f1 objects &&
+		echo does-not-exist &&
+		echo HEAD:morx &&
+		cut -d" " -f1 objects
+	} >batch-input
+'
+
+test_expect_success 'cat-file --batch --threads keeps the order of the input' '
+	git cat-file --batch --follow-symlinks <batch-input >expect &&
+	git cat-file --batch --follow-symlinks --threads=4 \
+		<batch-input >actual &&
+	test_cmp expect actual
+'
+
+test_expect_success 'cat-file --batch --threads streams big objects' '
+	git cat-file --batch <batch-input >expect &&
+	git -c core.bigFileThreshold=10 cat-file --batch --threads=4 \
+		<batch-input >actual &&
+	test_cmp expect actual
+'
+
+test_expect_success 'cat-file --batch-all-objects --batch --threads' '
+	git -C all-two cat-file --batch-all-objects --batch >expect &&
+	git -C all-two cat-file --batch-all-objects --batch --threads=4 \
+		>actual &&
+	test_cmp expect actual
+'
+
+test_expect_success 'cat-file --threads requires --batch' '
+	test_must_fail git cat-file --threads=2 -p HEAD &&
+	test_must_fail git cat-file --batch --textconv --threads=2 </dev/null
+'
+
 test_done
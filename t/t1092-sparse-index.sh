@@ -0,0 +1,163 @@
+#!/bin/sh
+
+test_description='sparse index
+
+The same operations are run in a sparse checkout with and without
+index.sparse, which must not make a difference to their outcome.
+'
+
+. ./test-lib.sh
+
+# Run "git $@" in both the "full" and the "sparse" repository and
+# make sure that the output, the index and the working tree are the
+# same in both.
+test_all () {
+	git -C full "$@" >full-out 2>full-err &&
+	git -C sparse "$@" >sparse-out 2>sparse-err &&
+	test_cmp full-out sparse-out &&
+	test_cmp full-err sparse-err &&
+	compare_repos
+}
+
+compare_repos () {
+	git -C full ls-files -s -t >full-index &&
+	git -C sparse ls-files -s -t >sparse-index &&
+	test_cmp full-index sparse-index &&
+	git -C full status --porcelain >full-status &&
+	git -C sparse status --porcelain >sparse-status &&
+	test_cmp full-status sparse-status &&
+	(cd full && find . -path ./.git -prune -o -print | sort) >full-files &&
+	(cd sparse && find . -path ./.git -prune -o -print | sort) >sparse-files &&
+	test_cmp full-files sparse-files
+}
+
+# Print the sparse directories of the index of "$1", or nothing if
+# the index is not sparse on disk.
+sparse_dirs () {
+	(cd "$1" && test-dump-sparse-index) | sed -n -e "s/^040000 [0-9a-f]* 0	//p"
+}
+
+test_expect_success 'setup' '
+	for d in in out deep/in deep/out deep/out/sub
+	do
+		mkdir -p $d &&
+		echo "$d a" >$d/a &&
+		echo "$d b" >$d/b || return 1
+	done &&
+	echo top >top &&
+	git add . &&
+	test_tick &&
+	git commit -m initial &&
+	git checkout -b side &&
+	echo side >>in/a &&
+	git commit -a -m "change in the sparse checkout" &&
+	git checkout -b outside master &&
+	echo outside >>out/a &&
+	echo outside >>deep/out/sub/b &&
+	git commit -a -m "change outside of the sparse checkout" &&
+	git checkout master &&
+
+	for r in full sparse
+	do
+		git clone -q --no-checkout . $r &&
+		git -C $r config core.sparseCheckout true &&
+		cat >$r/.git/info/sparse-checkout <<-\EOF &&
+		/top
+		/in/
+		/deep/in/
+		EOF
+		git -C $r checkout -q master || return 1
+	done &&
+	git -C sparse config index.sparse true &&
+	git -C sparse update-index --force-write-index &&
+	compare_repos
+'
+
+test_expect_success 'directories outside of the sparse checkout are collapsed' '
+	cat >expect <<-\EOF &&
+	deep/out/
+	out/
+	EOF
+	sparse_dirs sparse >actual &&
+	test_cmp expect actual &&
+	sparse_dirs full >actual &&
+	test_must_be_empty actual
+'
+
+test_expect_success 'commands that cannot cope see the full index' '
+	git -C full ls-files -s >expect &&
+	git -C sparse ls-files -s >actual &&
+	test_cmp expect actual &&
+	git -C sparse cat-file -p :out/a >actual &&
+	echo "out a" >expect &&
+	test_cmp expect actual &&
+	git -C sparse diff-files --exit-code &&
+	git -C sparse diff-index --cached --exit-code HEAD
+'
+
+test_expect_success 'status, add and commit' '
+	echo more >>sparse/in/b &&
+	echo more >>full/in/b &&
+	echo new >sparse/deep/in/new &&
+	echo new >full/deep/in/new &&
+	test_all status --porcelain &&
+	test_all add in deep &&
+	test_all commit -q -m "in the sparse checkout" &&
+	git -C full rev-parse HEAD^{tree} >expect &&
+	git -C sparse rev-parse HEAD^{tree} >actual &&
+	test_cmp expect actual &&
+	sparse_dirs sparse >actual &&
+	printf "deep/out/\nout/\n" >expect &&
+	test_cmp expect actual
+'
+
+test_expect_success 'checkout and reset keep the index sparse' '
+	test_all checkout -q side &&
+	test_all checkout -q master &&
+	test_all reset -q --hard side &&
+	test_all reset -q HEAD~1 &&
+	test_all reset -q --hard &&
+	sparse_dirs sparse >actual &&
+	printf "deep/out/\nout/\n" >expect &&
+	test_cmp expect actual
+'
+
+test_expect_success 'checkout of a change outside of the sparse checkout' '
+	test_all checkout -q outside &&
+	git -C sparse rev-parse outside:out >expect &&
+	sparse_dirs sparse >dirs &&
+	grep "^out/$" dirs &&
+	(cd sparse && test-dump-sparse-index) >actual &&
+	grep "$(cat expect)" actual &&
+	test_all checkout -q master
+'
+
+test_expect_success 'paths inside of a sparse directory' '
+	test_all checkout outside -- out/a &&
+	test_all add out/a &&
+	test_all reset -q HEAD -- out &&
+	test_all checkout HEAD -- out/a &&
+	test_all status --porcelain -- deep/out/sub/b
+'
+
+test_expect_success 'changing the sparse checkout expands the index' '
+	for r in full sparse
+	do
+		echo /out/ >>$r/.git/info/sparse-checkout &&
+		git -C $r read-tree -m -u HEAD || return 1
+	done &&
+	compare_repos &&
+	test_path_is_file sparse/out/a &&
+	sparse_dirs sparse >actual &&
+	echo deep/out/ >expect &&
+	test_cmp expect actual
+'
+
+test_expect_success 'disabling the sparse index' '
+	git -C sparse -c index.sparse=false update-index --force-write-index &&
+	sparse_dirs sparse >actual &&
+	test_must_be_empty actual &&
+	compare_repos
+'
+
+test_done
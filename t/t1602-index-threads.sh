@@ -0,0 +1,105 @@
+#!/bin/sh
+
+test_description='loading the index on multiple threads'
+
+. ./test-lib.sh
+
+# Print the 4-byte signatures of the extensions of .git/index that
+# the threaded reader relies on.
+index_extensions () {
+	perl -0777 -ne 'print "$1\n" while /(EOIE|IEOT)/g' .git/index
+}
+
+# Overwrite the entry count of the first IEOT block with "$1".
+corrupt_ieot () {
+	perl -0777 -pi -e '
+		s/(IEOT.{4}.{4}.{4})(.{4})/$1 . pack("N", '"$1"')/es
+	' .git/index
+}
+
+test_expect_success 'setup' '
+	for d in a b c d e
+	do
+		mkdir $d &&
+		for f in 1 2 3 4 5 6 7 8
+		do
+			echo "$d$f" >$d/file$f || return 1
+		done
+	done &&
+	git add . &&
+	test_tick &&
+	git commit -m initial &&
+	git checkout -b side &&
+	echo side >a/file1 &&
+	git commit -a -m side &&
+	git checkout master &&
+	echo master >a/file1 &&
+	git commit -a -m master &&
+	test_must_fail git merge side &&
+	echo resolved >a/file1 &&
+	git add a/file1 &&
+	git write-tree &&
+	git config core.untrackedCache true &&
+	echo untracked >untracked &&
+	git status >/dev/null
+'
+
+test_expect_success 'index.threads does not write the extensions when disabled' '
+	git -c index.threads=1 update-index --force-write-index --index-version 2 &&
+	index_extensions >actual &&
+	test_must_be_empty actual
+'
+
+for version in 2 3 4
+do
+	test_expect_success "threaded load of a version $version index" '
+		git update-index --index-version $version &&
+		git ls-files --stage --resolve-undo >expect &&
+		git -c index.threads=3 update-index --force-write-index --index-version $version &&
+		index_extensions >actual &&
+		printf "IEOT\nEOIE\n" >expect.ext &&
+		test_cmp expect.ext actual &&
+		git -c index.threads=3 ls-files --stage --resolve-undo >actual &&
+		test_cmp expect actual &&
+		git -c index.threads=1 ls-files --stage --resolve-undo >actual &&
+		test_cmp expect actual &&
+		git -c index.threads=3 status --porcelain >actual &&
+		grep "^?? untracked" actual
+	'
+done
+
+test_expect_success 'recordEndOfIndexEntries and recordOffsetTable override index.threads' '
+	git -c index.threads=3 -c index.recordOffsetTable=false \
+		update-index --force-write-index --index-version 4 &&
+	index_extensions >actual &&
+	echo EOIE >expect.ext &&
+	test_cmp expect.ext actual &&
+	git -c index.threads=3 ls-files --stage >actual &&
+	git -c index.threads=1 ls-files --stage >expect &&
+	test_cmp expect actual &&
+	git -c index.threads=1 -c index.recordEndOfIndexEntries=true \
+		update-index --force-write-index --index-version 4 &&
+	index_extensions >actual &&
+	test_cmp expect.ext actual
+'
+
+test_expect_success 'a bogus offset table is ignored' '
+	git -c index.threads=3 update-index --force-write-index --index-version 4 &&
+	git -c index.threads=1 ls-files --stage >expect &&
+	corrupt_ieot 1 &&
+	git -c index.threads=3 ls-files --stage >actual &&
+	test_cmp expect actual
+'
+
+test_expect_success 'GIT_TEST_INDEX_THREADS writes and uses the extensions' '
+	git update-index --index-version 2 &&
+	git ls-files --stage >expect &&
+	GIT_TEST_INDEX_THREADS=2 git update-index --force-write-index &&
+	index_extensions >actual &&
+	printf "IEOT\nEOIE\n" >expect.ext &&
+	test_cmp expect.ext actual &&
+	GIT_TEST_INDEX_THREADS=2 git ls-files --stage >actual &&
+	test_cmp expect actual
+'
+
+test_done
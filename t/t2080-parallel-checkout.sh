@@ -0,0 +1,134 @@
+#!/bin/sh
+
+test_description='parallel checkout'
+
+. ./test-lib.sh
+
+# The whole suite may be run with parallel checkout forced on; these
+# tests pick the number of workers themselves.
+sane_unset GIT_TEST_CHECKOUT_WORKERS
+
+# Check out "$2" in the clone "$1" of the test repository with
+# checkout.workers=$3 and make sure that the working tree and the
+# index look the same as after a sequential checkout.
+checkout_and_compare () {
+	git -C "$1" -c checkout.workers=$3 \
+		-c checkout.thresholdForParallelism=0 checkout -q "$2" &&
+	git -C "$1" diff-index --quiet HEAD &&
+	git -C "$1" status --porcelain >status &&
+	test_must_be_empty status &&
+	git -C "$1" ls-files -s >actual &&
+	git -C "$1" ls-tree -r "$2" |
+	sed -e "s/ blob / /" -e "s/	/ 0	/" >expect &&
+	test_cmp expect actual
+}
+
+test_expect_success 'setup' '
+	for d in a b c d
+	do
+		mkdir -p $d/sub &&
+		for f in 1 2 3 4 5 6 7 8 9 10
+		do
+			echo "$d $f" >$d/file$f &&
+			echo "$d sub $f" >$d/sub/file$f || return 1
+		done
+	done &&
+	echo "#!/bin/sh" >a/script &&
+	chmod +x a/script &&
+	test_ln_s_add file1 a/link &&
+	git add . &&
+	test_tick &&
+	git commit -m base &&
+	git tag base &&
+	git rm -rq b &&
+	for f in 1 2 3 4 5 6 7 8 9 10
+	do
+		echo "changed $f" >a/file$f &&
+		echo "new $f" >c/new$f || return 1
+	done &&
+	echo "b is a file now" >b &&
+	echo "\$Id\$" >c/ident &&
+	git add . &&
+	test_tick &&
+	git commit -m changed &&
+	git tag changed &&
+	git checkout -q base
+'
+
+test_expect_success 'parallel checkout between distant commits' '
+	git clone -q --no-checkout . clone &&
+	checkout_and_compare clone base 4 &&
+	test -x clone/a/script &&
+	checkout_and_compare clone changed 4 &&
+	test_path_is_file clone/b &&
+	checkout_and_compare clone base 4 &&
+	test_path_is_dir clone/b
+'
+
+test_expect_success 'parallel checkout gives the same result as sequential' '
+	git clone -q --no-checkout . parallel &&
+	git clone -q --no-checkout . sequential &&
+	checkout_and_compare parallel changed 3 &&
+	checkout_and_compare sequential changed 1 &&
+	git diff --no-index sequential/a parallel/a &&
+	git diff --no-index sequential/c parallel/c
+'
+
+test_expect_success 'parallel checkout applies conversions' '
+	for r in conv conv-sequential
+	do
+		git clone -q --no-checkout . $r &&
+		cat >$r/.git/info/attributes <<-\EOF || return 1
+		a/* text eol=crlf
+		c/* ident
+		EOF
+	done &&
+	checkout_and_compare conv changed 4 &&
+	checkout_and_compare conv-sequential changed 1 &&
+	printf "changed 1\r\n" >expect &&
+	test_cmp expect conv/a/file1 &&
+	grep "Id: $(git rev-parse changed:c/ident)" conv/c/ident &&
+	git diff --no-index conv-sequential/a conv/a &&
+	git diff --no-index conv-sequential/c conv/c
+'
+
+test_expect_success 'entries with a filter driver are left to the sequential code' '
+	git clone -q --no-checkout . filter &&
+	echo "d/* filter=rot13" >filter/.git/info/attributes &&
+	git -C filter config filter.rot13.smudge ./rot13.sh &&
+	write_script filter/rot13.sh <<-\EOF &&
+	tr "a-zA-Z" "n-za-mN-ZA-M"
+	EOF
+	git -C filter -c checkout.workers=4 \
+		-c checkout.thresholdForParallelism=0 checkout -q changed &&
+	echo "q 1" >expect &&
+	test_cmp expect filter/d/file1 &&
+	echo "changed 1" >expect &&
+	test_cmp expect filter/a/file1
+'
+
+test_expect_success 'large blobs are still streamed' '
+	git clone -q --no-checkout . large &&
+	git -C large config core.bigFileThreshold 4 &&
+	checkout_and_compare large changed 4 &&
+	echo "changed 10" >expect &&
+	test_cmp expect large/a/file10
+'
+
+test_expect_success CASE_INSENSITIVE_FS 'colliding paths are checked out' '
+	git init collide &&
+	(
+		cd collide &&
+		blob=$(echo content | git hash-object -w --stdin) &&
+		printf "100644 $blob\tFILE\n100644 $blob\tfile\n" |
+		git update-index --index-info &&
+		git commit -q -m collide &&
+		rm -f FILE file &&
+		git -c checkout.workers=2 \
+			-c checkout.thresholdForParallelism=0 reset -q --hard &&
+		echo content >expect &&
+		test_cmp expect file
+	)
+'
+
+test_done
@@ -128,6 +128,32 @@ test_expect_success \
      done'
 cd "$TRASH"
 
+test_expect_success 'unpack with threads' '
+	for pack in test-2-$packname_2 test-3-$packname_3
+	do
+		rm -rf threaded &&
+		git init --bare threaded &&
+		git -C threaded unpack-objects --threads=4 <$pack.pack &&
+		(cd .git && find objects -type f -print) >paths &&
+		while read path
+		do
+			cmp .git/$path threaded/$path || return 1
+		done <paths || return 1
+	done
+'
+
+test_expect_success 'unpack with pack.threads' '
+	rm -rf threaded &&
+	git init --bare threaded &&
+	git -C threaded -c pack.threads=2 \
+		unpack-objects <test-3-$packname_3.pack &&
+	(cd .git && find objects -type f -print) >paths &&
+	while read path
+	do
+		cmp .git/$path threaded/$path || return 1
+	done <paths
+'
+
 test_expect_success 'compare delta flavors' '
 	perl -e '\''
 		defined($_ = -s $_) or die for @ARGV;
@@ -339,6 +365,18 @@ test_expect_success 'unpacking with --strict' '
 	)
 '
 
+test_expect_success 'unpack-objects --strict with threads' '
+	test_create_repo test-5-threads &&
+	(
+		cd test-5-threads &&
+		git unpack-objects --strict --threads=4 <../test-5-$PACK5.pack &&
+		git ls-tree -r $LIST &&
+		git ls-tree -r $LI &&
+		git ls-tree -r $ST &&
+		git fsck
+	)
+'
+
 test_expect_success 'index-pack with --strict' '
 
 	for j in a b c d e f g
@@ -457,6 +495,32 @@ test_expect_success !PTHREADS,C_LOCALE_OUTPUT 'pack-objects --threads=N or pack.
 	grep -F "no threads support, ignoring pack.threads" err
 '
 
+test_expect_success 'pack-objects with small in-core limits writes the same pack' '
+	git rev-list --objects --all >obj-list &&
+	git pack-objects --threads=1 --no-reuse-delta \
+		limits-default <obj-list >default.name &&
+	GIT_TEST_OE_SIZE=10 GIT_TEST_OE_DELTA_SIZE=10 \
+	GIT_TEST_FULL_IN_PACK_ARRAY=1 \
+		git pack-objects --threads=1 --no-reuse-delta \
+		limits-small <obj-list >small.name &&
+	test_cmp default.name small.name
+'
+
+test_expect_success 'pack-objects reuses deltas with small in-core limits' '
+	git clone --no-local --bare . limits.git &&
+	GIT_TEST_OE_SIZE=10 GIT_TEST_OE_DELTA_SIZE=10 \
+		git -C limits.git pack-objects --threads=1 --stdout --all \
+		</dev/null >reuse.pack &&
+	git index-pack -o reuse.idx reuse.pack &&
+	git verify-pack reuse.pack
+'
+
+test_expect_success 'pack-objects caps --depth' '
+	git pack-objects --depth=5000 --stdout --all </dev/null \
+		>/dev/null 2>err &&
+	test_i18ngrep "forcing 4095" err
+'
+
 #
 # WARNING!
 #
@@ -121,10 +121,14 @@ test_expect_success 'fetch (partial bitmap)' '
 	test_cmp expect actual
 '
 
-test_expect_success 'incremental repack fails when bitmaps are requested' '
+test_expect_success 'incremental repack writes a bitmap layer' '
 	test_commit more-1 &&
-	test_must_fail git repack -d 2>err &&
-	test_i18ngrep "Incremental repacks are incompatible with bitmap" err
+	git repack -d &&
+	ls .git/objects/pack/*.bitmap-layer >layers &&
+	test_line_count = 1 layers &&
+	git rev-list --test-bitmap HEAD &&
+	# the remaining tests expect a single bitmap file
+	rm $(cat layers)
 '
 
 test_expect_success 'incremental repack can disable bitmaps' '
@@ -331,4 +335,25 @@ test_expect_success 'pack reuse respects --incremental' '
 	git show-index <empty.idx >actual &&
 	test_cmp expect actual
 '
+test_expect_success 'whole-pack reuse sends the packfile as it is' '
+	git repack -adb &&
+	reusable_pack >whole.pack &&
+	test_cmp_bin .git/objects/pack/pack-*.pack whole.pack
+'
+
+test_expect_success 'partial pack reuse fixes up delta offsets' '
+	for tips in other master~3 "master other~4" side-3
+	do
+		echo $tips | tr " " "\n" >tips &&
+		git rev-list --objects --stdin <tips | cut -d" " -f1 |
+			sort >expect &&
+		git pack-objects --delta-base-offset --revs --stdout \
+			<tips >partial.pack &&
+		rm -f partial.idx &&
+		git index-pack partial.pack &&
+		git show-index <partial.idx | cut -d" " -f2 | sort >actual &&
+		test_cmp expect actual || return 1
+	done
+'
+
 test_done
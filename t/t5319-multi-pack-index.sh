@@ -0,0 +1,192 @@
+#!/bin/sh
+
+test_description='multi-pack-indexes'
+. ./test-lib.sh
+
+objdir=.git/objects
+
+midx_read_expect () {
+	NUM_PACKS=$1
+	NUM_OBJECTS=$2
+	NUM_CHUNKS=4
+	OBJECT_DIR=$3
+	EXTRA_CHUNKS=""
+	{
+		cat <<-EOF &&
+		header: 4d494458 1 $NUM_CHUNKS $NUM_PACKS
+		chunks: pack-names oid-fanout oid-lookup object-offsets$EXTRA_CHUNKS
+		num_objects: $NUM_OBJECTS
+		packs:
+		EOF
+		if test $NUM_PACKS -ge 1
+		then
+			ls $OBJECT_DIR/pack/ | grep idx | sort
+		fi
+	} >expect &&
+	git multi-pack-index --object-dir=$OBJECT_DIR read >actual &&
+	test_cmp expect actual
+}
+
+test_expect_success 'write midx with no packs' '
+	test_when_finished rm -f pack/multi-pack-index &&
+	git multi-pack-index --object-dir=. write &&
+	midx_read_expect 0 0 .
+'
+
+generate_objects () {
+	i=$1
+	iii=$(printf '%03i' $i)
+	{
+		test-genrandom "bar" 200 &&
+		test-genrandom "baz $iii" 50
+	} >wide_delta_$iii &&
+	{
+		test-genrandom "foo"$i 100 &&
+		test-genrandom "foo"$(( $i + 1 )) 100 &&
+		test-genrandom "foo"$(( $i + 2 )) 100
+	} >deep_delta_$iii &&
+	{
+		echo $iii &&
+		test-genrandom "$iii" 8192
+	} >file_$iii &&
+	git update-index --add file_$iii deep_delta_$iii wide_delta_$iii
+}
+
+commit_and_list_objects () {
+	{
+		echo 101 &&
+		test-genrandom 100 8192;
+	} >file_101 &&
+	git update-index --add file_101 &&
+	tree=$(git write-tree) &&
+	commit=$(git commit-tree $tree -p HEAD</dev/null) &&
+	{
+		echo $tree &&
+		git ls-tree $tree | sed -e "s/.* \\([0-9a-f]*\\)	.*/\\1/"
+	} >obj-list &&
+	git reset --hard $commit
+}
+
+test_expect_success 'create objects' '
+	test_commit initial &&
+	for i in $(test_seq 1 5)
+	do
+		generate_objects $i
+	done &&
+	commit_and_list_objects
+'
+
+test_expect_success 'write midx with one v1 pack' '
+	pack=$(git pack-objects --index-version=1 $objdir/pack/test <obj-list) &&
+	test_when_finished rm $objdir/pack/test-$pack.pack \
+		$objdir/pack/test-$pack.idx $objdir/pack/multi-pack-index &&
+	git multi-pack-index --object-dir=$objdir write &&
+	midx_read_expect 1 18 $objdir
+'
+
+midx_git_two_modes () {
+	git -c core.multiPackIndex=false $1 >expect &&
+	git -c core.multiPackIndex=true $1 >actual &&
+	test_cmp expect actual
+}
+
+compare_results_with_midx () {
+	MSG=$1
+	test_expect_success "check normal git operations: $MSG" '
+		midx_git_two_modes "rev-list --objects --all" &&
+		midx_git_two_modes "log --raw" &&
+		midx_git_two_modes "count-objects --verbose" &&
+		midx_git_two_modes "cat-file --batch-all-objects --batch-check"
+	'
+}
+
+test_expect_success 'write midx with one v2 pack' '
+	git pack-objects --index-version=2,0x40 $objdir/pack/test <obj-list &&
+	git multi-pack-index --object-dir=$objdir write &&
+	midx_read_expect 1 18 $objdir
+'
+
+compare_results_with_midx "one v2 pack"
+
+test_expect_success 'add more objects' '
+	for i in $(test_seq 6 10)
+	do
+		generate_objects $i
+	done &&
+	commit_and_list_objects
+'
+
+test_expect_success 'write midx with two packs' '
+	git pack-objects --index-version=1 $objdir/pack/test-2 <obj-list &&
+	git multi-pack-index --object-dir=$objdir write &&
+	midx_read_expect 2 34 $objdir
+'
+
+compare_results_with_midx "two packs"
+
+test_expect_success 'add more packs' '
+	for j in $(test_seq 11 20)
+	do
+		generate_objects $j &&
+		commit_and_list_objects &&
+		git pack-objects --index-version=2 $objdir/pack/test-pack <obj-list
+	done
+'
+
+compare_results_with_midx "mixed mode (two packs + extra)"
+
+test_expect_success 'write midx with twelve packs' '
+	git multi-pack-index --object-dir=$objdir write &&
+	midx_read_expect 12 74 $objdir
+'
+
+compare_results_with_midx "twelve packs"
+
+test_expect_success 'rewriting the midx reuses it for covered packs' '
+	cp $objdir/pack/multi-pack-index midx-before &&
+	git multi-pack-index --object-dir=$objdir write &&
+	test_cmp_bin midx-before $objdir/pack/multi-pack-index
+'
+
+test_expect_success 'midx drops packs that were removed' '
+	pack=$(ls $objdir/pack/test-2-*.pack) &&
+	mv $pack removed.pack &&
+	mv ${pack%.pack}.idx removed.idx &&
+	git multi-pack-index --object-dir=$objdir write &&
+	midx_read_expect 11 73 $objdir &&
+	mv removed.pack $pack &&
+	mv removed.idx ${pack%.pack}.idx &&
+	git multi-pack-index --object-dir=$objdir write &&
+	midx_read_expect 12 74 $objdir
+'
+
+test_expect_success 'repack rewrites an existing midx' '
+	git repack -adf &&
+	midx_read_expect 1 88 $objdir
+'
+
+compare_results_with_midx "after repack"
+
+test_expect_success 'midx in an alternate is used' '
+	git clone --shared . alt-clone &&
+	git -C alt-clone -c core.multiPackIndex=true rev-list --objects --all >actual &&
+	git rev-list --objects --all >expect &&
+	test_cmp expect actual
+'
+
+test_expect_success 'corrupt midx signature is reported and ignored' '
+	cp $objdir/pack/multi-pack-index midx-backup &&
+	printf "XXXX" | dd of=$objdir/pack/multi-pack-index bs=1 conv=notrunc &&
+	git -c core.multiPackIndex=true rev-list --objects --all >actual 2>err &&
+	test_i18ngrep "signature" err &&
+	git -c core.multiPackIndex=false rev-list --objects --all >expect &&
+	test_cmp expect actual &&
+	mv midx-backup $objdir/pack/multi-pack-index
+'
+
+test_expect_success 'clear removes the midx' '
+	git multi-pack-index --object-dir=$objdir clear &&
+	test_path_is_missing $objdir/pack/multi-pack-index
+'
+
+test_done
@@ -0,0 +1,147 @@
+#!/bin/sh
+
+test_description='incremental bitmap layers'
+. ./test-lib.sh
+
+# show objects present in pack ($1 should be associated *.idx)
+list_packed_objects () {
+	git show-index <"$1" | cut -d' ' -f2
+}
+
+test_expect_success 'setup repo with bitmapped history' '
+	for i in $(test_seq 1 10)
+	do
+		test_commit $i
+	done &&
+	git checkout -b other HEAD~5 &&
+	for i in $(test_seq 1 10)
+	do
+		test_commit side-$i
+	done &&
+	git checkout master &&
+	git config repack.writebitmaps true &&
+	git config pack.writebitmaphashcache true &&
+	git repack -ad &&
+	ls .git/objects/pack/*.bitmap >bitmaps &&
+	test_line_count = 1 bitmaps &&
+	base=$(basename $(cat bitmaps) .bitmap)
+'
+
+test_expect_success 'incremental repack without bitmaps fails' '
+	git init no-bitmaps &&
+	test_commit -C no-bitmaps one &&
+	test_must_fail git -C no-bitmaps repack -d -b 2>err &&
+	test_i18ngrep "need an existing bitmap index" err
+'
+
+test_expect_success 'incremental repack writes a bitmap layer' '
+	for i in $(test_seq 1 5)
+	do
+		test_commit further-$i
+	done &&
+	git checkout other &&
+	test_commit side-further &&
+	git merge -m merge master &&
+	git checkout master &&
+	git repack -d &&
+	ls .git/objects/pack/*.bitmap-layer >layers &&
+	test_line_count = 1 layers &&
+	layer=$(basename $(cat layers) .bitmap-layer) &&
+	test_path_is_file .git/objects/pack/$base.bitmap &&
+	list_packed_objects .git/objects/pack/$base.idx >base.objects &&
+	list_packed_objects .git/objects/pack/$layer.idx >layer.objects &&
+	git rev-parse further-1 >expect &&
+	grep -f expect layer.objects &&
+	git rev-parse 10 >expect &&
+	! grep -f expect layer.objects &&
+	! grep -f base.objects layer.objects
+'
+
+test_expect_success 'rev-list --test-bitmap verifies layer bitmaps' '
+	git rev-list --test-bitmap master 2>err &&
+	grep OK err &&
+	git rev-list --test-bitmap other 2>err &&
+	grep OK err
+'
+
+rev_list_tests () {
+	state=$1
+
+	test_expect_success "counting commits via bitmap ($state)" '
+		git rev-list --count master other >expect &&
+		git rev-list --use-bitmap-index --count master other >actual &&
+		test_cmp expect actual
+	'
+
+	test_expect_success "counting partial commits via bitmap ($state)" '
+		git rev-list --count other..master >expect &&
+		git rev-list --use-bitmap-index --count other..master >actual &&
+		test_cmp expect actual
+	'
+
+	test_expect_success "enumerate --objects ($state)" '
+		git rev-list --objects --use-bitmap-index master other >tmp &&
+		cut -d" " -f1 <tmp | sort >actual &&
+		git rev-list --objects master other >tmp &&
+		cut -d" " -f1 <tmp | sort >expect &&
+		test_cmp expect actual
+	'
+
+	test_expect_success "pack-objects with bitmap ($state)" '
+		git pack-objects --no-use-bitmap-index --all packa </dev/null >packa &&
+		git pack-objects --use-bitmap-index --all packb </dev/null >packb &&
+		list_packed_objects packa-$(cat packa).idx >packa.objects &&
+		list_packed_objects packb-$(cat packb).idx >packb.objects &&
+		test_cmp packa.objects packb.objects &&
+		rm -f packa-* packb-*
+	'
+}
+
+rev_list_tests 'one layer'
+
+test_expect_success 'second layer stacks on top of the first' '
+	test_commit more-1 &&
+	test_commit more-2 &&
+	git repack -d &&
+	ls .git/objects/pack/*.bitmap-layer >layers &&
+	test_line_count = 2 layers &&
+	git rev-list --test-bitmap master 2>err &&
+	grep OK err
+'
+
+rev_list_tests 'two layers'
+
+test_expect_success 'clone from layered bitmaps' '
+	git clone --no-local --bare . clone.git &&
+	git rev-parse master >expect &&
+	git --git-dir=clone.git rev-parse master >actual &&
+	test_cmp expect actual &&
+	git --git-dir=clone.git fsck
+'
+
+test_expect_success 'fetch from layered bitmaps' '
+	test_commit more-3 &&
+	git repack -d &&
+	git --git-dir=clone.git fetch origin master:master &&
+	git rev-parse master >expect &&
+	git --git-dir=clone.git rev-parse master >actual &&
+	test_cmp expect actual
+'
+
+test_expect_success 'layer whose base is gone is ignored' '
+	mv .git/objects/pack/$base.bitmap base.bitmap &&
+	git rev-list --count master >expect &&
+	git rev-list --use-bitmap-index --count master >actual &&
+	test_cmp expect actual &&
+	mv base.bitmap .git/objects/pack/$base.bitmap
+'
+
+test_expect_success 'full repack removes the layers' '
+	git repack -ad &&
+	ls .git/objects/pack/ | grep bitmap >output &&
+	test_line_count = 1 output &&
+	git rev-list --test-bitmap master 2>err &&
+	grep OK err
+'
+
+test_done
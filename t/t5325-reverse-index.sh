@@ -0,0 +1,130 @@
+#!/bin/sh
+
+test_description='on-disk reverse index'
+. ./test-lib.sh
+
+packdir=.git/objects/pack
+
+test_expect_success 'setup' '
+	test_commit base &&
+	for i in 1 2 3 4 5
+	do
+		test-genrandom "blob $i" 4096 >file-$i &&
+		git add file-$i &&
+		test_tick &&
+		git commit -m "commit $i" || return 1
+	done &&
+	git repack -ad &&
+	pack=$(ls $packdir/pack-*.pack) &&
+	rev=${pack%.pack}.rev &&
+	test_path_is_missing $rev
+'
+
+test_expect_success 'index-pack --rev-index writes a .rev file' '
+	git index-pack --rev-index -o tmp.idx $pack &&
+	test_path_is_file tmp.rev &&
+	git index-pack -o tmp2.idx $pack &&
+	test_path_is_missing tmp2.rev
+'
+
+test_expect_success 'index-pack --no-rev-index overrides pack.writeReverseIndex' '
+	git -c pack.writeReverseIndex=true \
+		index-pack -o tmp3.idx $pack &&
+	test_path_is_file tmp3.rev &&
+	git -c pack.writeReverseIndex=true \
+		index-pack --no-rev-index -o tmp4.idx $pack &&
+	test_path_is_missing tmp4.rev
+'
+
+test_expect_success 'index-pack refuses to name a .rev after a non-.idx file' '
+	test_must_fail git index-pack --rev-index -o tmp.index $pack
+'
+
+test_expect_success 'index-pack --verify does not write a .rev file' '
+	git index-pack --rev-index --verify $pack &&
+	test_path_is_missing $rev
+'
+
+test_expect_success 'repack writes a .rev file with pack.writeReverseIndex' '
+	git -c pack.writeReverseIndex=true repack -ad &&
+	pack=$(ls $packdir/pack-*.pack) &&
+	rev=${pack%.pack}.rev &&
+	test_path_is_file $rev &&
+	git index-pack --rev-index -o check.idx $pack &&
+	test_cmp check.rev $rev
+'
+
+test_expect_success 'the .rev file is used instead of an in-memory revindex' '
+	mv $rev rev.bak &&
+	git cat-file --batch-all-objects \
+		--batch-check="%(objectname) %(objectsize:disk)" >expect.sizes &&
+	mv rev.bak $rev &&
+	GIT_TEST_REV_INDEX_DIE_IN_MEMORY=1 git cat-file --batch-all-objects \
+		--batch-check="%(objectname) %(objectsize:disk)" >actual &&
+	test_cmp expect.sizes actual
+'
+
+test_expect_success 'pack-objects can reuse objects through the .rev file' '
+	GIT_TEST_REV_INDEX_DIE_IN_MEMORY=1 \
+		git pack-objects --all --stdout </dev/null >reused.pack &&
+	git index-pack -o reused.idx reused.pack
+'
+
+test_expect_success 'bitmaps use the .rev file' '
+	git -c pack.writeReverseIndex=true repack -adb &&
+	GIT_TEST_REV_INDEX_DIE_IN_MEMORY=1 git rev-list --test-bitmap HEAD
+'
+
+test_expect_success 'pushed packs get a .rev file' '
+	git init --bare dst.git &&
+	git -C dst.git config pack.writeReverseIndex true &&
+	git -C dst.git config receive.unpackLimit 1 &&
+	git push dst.git HEAD:refs/heads/master &&
+	ls dst.git/objects/pack/pack-*.pack >packs &&
+	ls dst.git/objects/pack/pack-*.rev >revs &&
+	test_line_count = 1 packs &&
+	test_line_count = 1 revs
+'
+
+test_expect_success 'a truncated .rev file is ignored' '
+	pack=$(ls $packdir/pack-*.pack) &&
+	rev=${pack%.pack}.rev &&
+	git cat-file --batch-all-objects \
+		--batch-check="%(objectname) %(objectsize:disk)" >expect.sizes &&
+	cp $rev rev.bak &&
+	test_when_finished "mv rev.bak $rev" &&
+	chmod u+w $rev &&
+	printf "RIDX" >$rev &&
+	git cat-file --batch-all-objects \
+		--batch-check="%(objectname) %(objectsize:disk)" \
+		>actual 2>err &&
+	test_cmp expect.sizes actual &&
+	test_i18ngrep "wrong size" err
+'
+
+test_expect_success 'a .rev file of another pack is ignored' '
+	pack=$(ls $packdir/pack-*.pack) &&
+	rev=${pack%.pack}.rev &&
+	git cat-file --batch-all-objects \
+		--batch-check="%(objectname) %(objectsize:disk)" >expect.sizes &&
+	cp $rev rev.bak &&
+	test_when_finished "mv rev.bak $rev" &&
+	chmod u+w $rev &&
+	size=$(wc -c <$rev) &&
+	printf "\377\377\377\377" |
+		dd of=$rev bs=1 seek=$(($size - 40)) conv=notrunc &&
+	git cat-file --batch-all-objects \
+		--batch-check="%(objectname) %(objectsize:disk)" \
+		>actual 2>err &&
+	test_cmp expect.sizes actual &&
+	test_i18ngrep "does not match its pack" err
+'
+
+test_expect_success 'repack -d removes the .rev files of redundant packs' '
+	git -c pack.writeReverseIndex=true repack -ad &&
+	git repack -ad &&
+	find $packdir -name "*.rev" >revs &&
+	test_line_count = 0 revs
+'
+
+test_done
@@ -817,6 +817,31 @@ do
 	"
 done
 
+test_expect_success PTHREADS 'grep --threads reads deltified objects in parallel' '
+	git init deltas &&
+	(
+		cd deltas &&
+		for f in 1 2 3 4 5 6 7 8
+		do
+			test_seq 1000 >file$f || return 1
+		done &&
+		git add . &&
+		git commit -m base &&
+		for i in $(test_seq 10)
+		do
+			for f in 1 2 3 4 5 6 7 8
+			do
+				echo "needle $i" >>file$f || return 1
+			done &&
+			git commit -q -a -m "commit $i" || return 1
+		done &&
+		git repack -adf --depth=10 &&
+		git grep --threads=1 -c needle $(git rev-list HEAD) >expect &&
+		git grep --threads=8 -c needle $(git rev-list HEAD) >actual &&
+		test_cmp expect actual
+	)
+'
+
 test_expect_success !PTHREADS,C_LOCALE_OUTPUT 'grep --threads=N or pack.threads=N warns when no pthreads' '
 	git grep --threads=2 Hello hello_world 2>err &&
 	grep ^warning: err >warnings &&
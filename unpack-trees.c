@@ -16,6 +16,8 @@
 #include "submodule-config.h"
 #include "fsmonitor.h"
 #include "fetch-object.h"
+#include "parallel-checkout.h"
+#include "sparse-index.h"
 
 /*
  * Error messages expected by scripts out of plumbing commands such as
@@ -371,6 +373,8 @@ static int check_updates(struct unpack_trees_options *o)
 		load_gitmodules_file(index, &state);
 
 	enable_delayed_checkout(&state);
+	if (o->update && !o->dry_run)
+		enable_parallel_checkout(&state);
 	if (repository_format_partial_clone && o->update && !o->dry_run) {
 		/*
 		 * Prefetch the objects that are to be checked out in the loop
@@ -407,6 +411,7 @@ static int check_updates(struct unpack_trees_options *o)
 			}
 		}
 	}
+	errs |= finish_parallel_checkout(&state);
 	stop_progress(&progress);
 	errs |= finish_delayed_checkout(&state);
 	if (o->update)
@@ -984,6 +989,38 @@ static void debug_unpack_callback(int n,
 		debug_name_entry(i, names + i);
 }
 
+/*
+ * If the index has a sparse directory entry for the directory "p" the
+ * traversal is about to descend into, carry it over to the result as it
+ * is.  unpack_trees() made sure that the trees all agree with it.
+ */
+static int unpack_sparse_directory(int n, const struct name_entry *names,
+				   struct traverse_info *info,
+				   const struct name_entry *p)
+{
+	struct unpack_trees_options *o = info->data;
+	struct cache_entry *ce;
+	int i, pos;
+
+	if (!o->merge || !o->src_index->sparse_index)
+		return 0;
+	pos = find_cache_pos(info, p);
+	if (pos >= -1)
+		return 0;
+	ce = o->src_index->cache[-2 - pos];
+	if (!S_ISSPARSEDIR(ce->ce_mode) ||
+	    ce_namelen(ce) != traverse_path_len(info, p) + 1)
+		return 0;
+
+	for (i = 0; i < n; i++)
+		if (!names[i].oid || !S_ISDIR(names[i].mode) ||
+		    oidcmp(names[i].oid, &ce->oid))
+			BUG("sparse directory %s differs from the trees", ce->name);
+	add_entry(o, ce, 0, 0);
+	mark_ce_used(ce, o);
+	return 1;
+}
+
 static int unpack_callback(int n, unsigned long mask, unsigned long dirmask, struct name_entry *names, struct traverse_info *info)
 {
 	struct cache_entry *src[MAX_UNPACK_TREES + 1] = { NULL, };
@@ -1047,6 +1084,9 @@ static int unpack_callback(int n, unsigned long mask, unsigned long dirmask, str
 
 	/* Now handle any directories.. */
 	if (dirmask) {
+		if (unpack_sparse_directory(n, names, info, p))
+			return mask;
+
 		/* special case: "diff-index --cached" looking at a tree */
 		if (o->diff_index_cached &&
 		    n == 1 && dirmask == 1 && S_ISDIR(names->mode)) {
@@ -1158,6 +1198,15 @@ static int clear_ce_flags_1(struct cache_entry **cache, int nr,
 		if (prefix->len && strncmp(ce->name, prefix->buf, prefix->len))
 			break;
 
+		/*
+		 * A sparse directory is outside of the sparse checkout
+		 * as a whole; see prepare_sparse_index().
+		 */
+		if (S_ISSPARSEDIR(ce->ce_mode)) {
+			cache++;
+			continue;
+		}
+
 		name = ce->name + prefix->len;
 		slash = strchr(name, '/');
 
@@ -1219,9 +1268,9 @@ static int clear_ce_flags(struct cache_entry **cache, int nr,
 /*
  * Set/Clear CE_NEW_SKIP_WORKTREE according to $GIT_DIR/info/sparse-checkout
  */
-static void mark_new_skip_worktree(struct exclude_list *el,
-				   struct index_state *the_index,
-				   int select_flag, int skip_wt_flag)
+void mark_new_skip_worktree(struct exclude_list *el,
+			    struct index_state *the_index,
+			    int select_flag, int skip_wt_flag)
 {
 	int i;
 
@@ -1252,6 +1301,54 @@ static void mark_new_skip_worktree(struct exclude_list *el,
 static int verify_absent(const struct cache_entry *,
 			 enum unpack_trees_error_types,
 			 struct unpack_trees_options *);
+/*
+ * The sparse directories of the index can only be carried over to the
+ * result as they are if they are the same in all the trees, as they
+ * are not looked into; if the sparse checkout is applied, it must also
+ * still be the one under which they were collapsed.  Expand the index
+ * if that is not the case.
+ */
+static void prepare_sparse_index(unsigned len, struct tree_desc *t,
+				 struct unpack_trees_options *o)
+{
+	struct index_state *istate = o->src_index;
+	unsigned char sha1[GIT_MAX_RAWSZ];
+	int i;
+	unsigned j;
+
+	if (!istate->sparse_index)
+		return;
+	if (!len || !o->merge || o->prefix ||
+	    (!o->skip_sparse_checkout &&
+	     (sparse_checkout_patterns_sha1(sha1) ||
+	      hashcmp(sha1, istate->sparse_checkout_sha1)))) {
+		ensure_full_index(istate);
+		return;
+	}
+	if (o->pathspec) {
+		expand_index_for_pathspec(istate, o->pathspec);
+		if (!istate->sparse_index)
+			return;
+	}
+
+	for (i = 0; i < istate->cache_nr; i++) {
+		const struct cache_entry *ce = istate->cache[i];
+
+		if (!S_ISSPARSEDIR(ce->ce_mode))
+			continue;
+		for (j = 0; j < len; j++) {
+			unsigned char tree_sha1[GIT_MAX_RAWSZ];
+			unsigned mode;
+
+			if (get_tree_entry_from_desc(t + j, ce->name, tree_sha1, &mode) ||
+			    !S_ISDIR(mode) || hashcmp(tree_sha1, ce->oid.hash)) {
+				ensure_full_index(istate);
+				return;
+			}
+		}
+	}
+}
+
 /*
  * N-way merge "len" trees.  Returns 0 on success, -1 on failure to manipulate the
  * resulting index, -2 on failure to reflect the changes to the work tree.
@@ -1279,8 +1376,12 @@ int unpack_trees(unsigned len, struct tree_desc *t, struct unpack_trees_options
 		free(sparse);
 	}
 
+	prepare_sparse_index(len, t, o);
+
 	memset(&o->result, 0, sizeof(o->result));
 	o->result.initialized = 1;
+	o->result.sparse_index = o->src_index->sparse_index;
+	hashcpy(o->result.sparse_checkout_sha1, o->src_index->sparse_checkout_sha1);
 	o->result.timestamp.sec = o->src_index->timestamp.sec;
 	o->result.timestamp.nsec = o->src_index->timestamp.nsec;
 	o->result.version = o->src_index->version;
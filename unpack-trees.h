@@ -87,4 +87,13 @@ int bind_merge(const struct cache_entry * const *src,
 int oneway_merge(const struct cache_entry * const *src,
 		 struct unpack_trees_options *o);
 
+/*
+ * Set "skip_wt_flag" on the entries of "the_index" (only those with
+ * "select_flag", if it is non-zero) that are outside of the sparse
+ * checkout defined by "el", and clear it on the others.
+ */
+void mark_new_skip_worktree(struct exclude_list *el,
+			    struct index_state *the_index,
+			    int select_flag, int skip_wt_flag);
+
 #endif